@@ -0,0 +1,260 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "rm.h"
+
+// Microbenchmark of rm_request and rm_release
+// Each thread repeatedly requests resources of one type and releases them again, so threads never hold
+// resources while waiting and the run cannot deadlock. With probability contention% a request goes to
+// the hot type 0 that all threads share, otherwise to a random one of the other types
+// The result is printed as a single JSON object
+
+// Global Variables
+int numThreads = 4;
+int numTypes = 8;
+int capacity = 16;
+int sizeMax = 2;         // largest request size
+int sizeUniform = 1;     // 1: sizes are uniform in 1..sizeMax, 0: every request has sizeMax
+int contention = 50;     // percent of the requests that go to the hot type
+int avoid = 1;
+int waitMode = RM_WAIT_BLOCK;
+long opsPerThread = 100000;
+int detectIntervalMs = 10; // period of rm_detection in detection mode
+const char *tracePath = NULL; // file the calls are recorded to for rmreplay (-o)
+
+long long *requestLat;   // latencies of the requests in nanoseconds, opsPerThread per thread
+long long *releaseLat;   // latencies of the releases in nanoseconds, opsPerThread per thread
+volatile int workersDone = 0;
+
+// Function Signatures
+void* worker(void*);
+void* detector(void*);
+long long now_ns();
+int compare_ll(const void*, const void*);
+void print_percentiles(const char *name, long long *lat, long count);
+void usage();
+
+// Main Function
+int main(int argc, char **argv) {
+    int opt;
+    char dist[32] = "uniform:2";
+
+    while ((opt = getopt(argc, argv, "t:r:c:s:x:m:w:n:d:o:h")) != -1) {
+        switch (opt) {
+        case 't': numThreads = atoi(optarg); break;
+        case 'r': numTypes = atoi(optarg); break;
+        case 'c': capacity = atoi(optarg); break;
+        case 's':
+            snprintf(dist, sizeof(dist), "%s", optarg);
+            if (strncmp(optarg, "uniform:", 8) == 0) {
+                sizeUniform = 1;
+                sizeMax = atoi(optarg + 8);
+            }
+            else if (strncmp(optarg, "fixed:", 6) == 0) {
+                sizeUniform = 0;
+                sizeMax = atoi(optarg + 6);
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'x': contention = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "avoid") == 0) {
+                avoid = 1;
+            }
+            else if (strcmp(optarg, "detect") == 0) {
+                avoid = 0;
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'w':
+            if (strcmp(optarg, "block") == 0) {
+                waitMode = RM_WAIT_BLOCK;
+            }
+            else if (strcmp(optarg, "adaptive") == 0) {
+                waitMode = RM_WAIT_ADAPTIVE;
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'n': opsPerThread = atol(optarg); break;
+        case 'd': detectIntervalMs = atoi(optarg); break;
+        case 'o': tracePath = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (numThreads < 1 || numTypes < 1 || capacity < 1 || sizeMax < 1 || sizeMax > capacity ||
+        contention < 0 || contention > 100 || opsPerThread < 1 || detectIntervalMs < 1) {
+        usage();
+    }
+
+    int *exist = malloc(numTypes * sizeof(int));
+    int *tids = malloc(numThreads * sizeof(int));
+    pthread_t *threadArray = malloc(numThreads * sizeof(pthread_t));
+    requestLat = malloc(numThreads * opsPerThread * sizeof(long long));
+    releaseLat = malloc(numThreads * opsPerThread * sizeof(long long));
+    if (exist == NULL || tids == NULL || threadArray == NULL || requestLat == NULL || releaseLat == NULL) {
+        fprintf(stderr, "rmbench: out of memory\n");
+        exit(1);
+    }
+
+    for (int j = 0; j < numTypes; j++) {
+        exist[j] = capacity;
+    }
+    rm_set_wait_mode(waitMode);
+    if (rm_init(numThreads, numTypes, exist, avoid) != 0) {
+        fprintf(stderr, "rmbench: rm_init failed\n");
+        exit(1);
+    }
+    if (tracePath != NULL && rm_trace_start(tracePath) != 0) {
+        fprintf(stderr, "rmbench: cannot record the trace to %s\n", tracePath);
+        exit(1);
+    }
+
+    long long start = now_ns();
+
+    pthread_t detectorThread;
+    if (avoid == 0) {
+        pthread_create(&detectorThread, NULL, detector, NULL);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        tids[i] = i;
+        pthread_create(&threadArray[i], NULL, worker, &tids[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threadArray[i], NULL);
+    }
+
+    long long elapsed = now_ns() - start;
+
+    workersDone = 1;
+    if (avoid == 0) {
+        pthread_join(detectorThread, NULL);
+    }
+    if (tracePath != NULL) {
+        rm_trace_stop();
+    }
+
+    struct rm_timing timing;
+    rm_get_timing(&timing);
+
+    struct rm_thread_stats *stats = malloc(numThreads * sizeof(struct rm_thread_stats));
+    long long blocks = 0, emptyWakeups = 0, rollbacks = 0;
+    if (stats != NULL && rm_get_stats(stats, NULL) == 0) {
+        for (int i = 0; i < numThreads; i++) {
+            blocks += stats[i].blocks;
+            emptyWakeups += stats[i].empty_wakeups;
+            rollbacks += stats[i].rollbacks;
+        }
+    }
+    free(stats);
+
+    long total = numThreads * opsPerThread;
+    printf("{\"mode\":\"%s\",\"wait\":\"%s\",\"threads\":%d,\"types\":%d,\"capacity\":%d,\"dist\":\"%s\",\"contention\":%d,",
+           avoid ? "avoid" : "detect", waitMode == RM_WAIT_ADAPTIVE ? "adaptive" : "block", numThreads, numTypes, capacity,
+           dist, contention);
+    printf("\"ops\":%ld,\"elapsed_s\":%.6f,\"ops_per_sec\":%.1f,",
+           2 * total, elapsed / 1e9, 2 * total / (elapsed / 1e9));
+    print_percentiles("request_ns", requestLat, total);
+    printf(",");
+    print_percentiles("release_ns", releaseLat, total);
+    printf(",\"blocks\":%lld,\"empty_wakeups\":%lld", blocks, emptyWakeups);
+    printf(",\"safety_check\":{\"calls\":%lld,\"cached\":%lld,\"ns\":%lld,\"rollbacks\":%lld}",
+           timing.safety_calls, timing.safety_cached, timing.safety_ns, rollbacks);
+    printf(",\"detection\":{\"calls\":%lld,\"ns\":%lld}}\n", timing.detection_calls, timing.detection_ns);
+
+    free(exist);
+    free(tids);
+    free(threadArray);
+    free(requestLat);
+    free(releaseLat);
+
+    return 0;
+}
+
+void* worker(void *a) {
+    int tid = *((int*) a);
+    unsigned int seed = tid + 1;
+    long long *reqLat = requestLat + tid * opsPerThread;
+    long long *relLat = releaseLat + tid * opsPerThread;
+    int *vec = calloc(numTypes, sizeof(int));
+
+    rm_thread_started(tid);
+
+    if (avoid) {
+        for (int j = 0; j < numTypes; j++) {
+            vec[j] = sizeMax;
+        }
+        rm_claim(vec);
+        memset(vec, 0, numTypes * sizeof(int));
+    }
+
+    for (long k = 0; k < opsPerThread; k++) {
+        int type = 0;
+        if (numTypes > 1 && (int) (rand_r(&seed) % 100) >= contention) {
+            type = 1 + rand_r(&seed) % (numTypes - 1);
+        }
+        vec[type] = sizeUniform ? 1 + rand_r(&seed) % sizeMax : sizeMax;
+
+        long long t0 = now_ns();
+        rm_request(vec);
+        long long t1 = now_ns();
+        rm_release(vec);
+        long long t2 = now_ns();
+
+        reqLat[k] = t1 - t0;
+        relLat[k] = t2 - t1;
+        vec[type] = 0;
+    }
+
+    rm_thread_ended();
+    free(vec);
+    pthread_exit(NULL);
+}
+
+void* detector(void *a) {
+    struct timespec interval = {detectIntervalMs / 1000, (detectIntervalMs % 1000) * 1000000L};
+
+    while (!workersDone) {
+        if (rm_detection() > 0) {
+            fprintf(stderr, "rmbench: unexpected deadlock\n");
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    pthread_exit(NULL);
+}
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *((const long long*) a);
+    long long y = *((const long long*) b);
+    return (x > y) - (x < y);
+}
+
+// Prints "name":{"p50":..,"p99":..,"p999":..} of the latencies (sorts them)
+void print_percentiles(const char *name, long long *lat, long count) {
+    qsort(lat, count, sizeof(long long), compare_ll);
+    printf("\"%s\":{\"p50\":%lld,\"p99\":%lld,\"p999\":%lld}", name,
+           lat[(long) (0.5 * (count - 1))], lat[(long) (0.99 * (count - 1))], lat[(long) (0.999 * (count - 1))]);
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./rmbench [-t threads] [-r types] [-c capacity] [-s uniform:K|fixed:K]\n"
+                    "                 [-x contention%%] [-m avoid|detect] [-w block|adaptive] [-n ops-per-thread]\n"
+                    "                 [-d detect-interval-ms] [-o trace]\n");
+    exit(1);
+}
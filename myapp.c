@@ -72,8 +72,8 @@ int main(int argc, char **argv) {
 void* threadfunc0(void* a) {
     if (AVOID == 0) {
         int tid;
-        int request1[MAXR] = {2, 1, 5, 3, 4, 2};
-        int request2[MAXR] = {0, 0, 3, 0, 0, 0};
+        int request1[NUMR] = {2, 1, 5, 3, 4, 2};
+        int request2[NUMR] = {0, 0, 3, 0, 0, 0};
         tid = *((int*)a);
 
         rm_thread_started(tid); // Let the library know that thread is started
@@ -96,9 +96,9 @@ void* threadfunc0(void* a) {
 
     else {
         int tid;
-        int request1[MAXR] = {2, 1, 3, 2, 3, 2};
-        int request2[MAXR] = {0, 1, 0, 0, 0, 0};
-        int claim[MAXR] = {3, 2, 6, 4, 5, 3};
+        int request1[NUMR] = {2, 1, 3, 2, 3, 2};
+        int request2[NUMR] = {0, 1, 0, 0, 0, 0};
+        int claim[NUMR] = {3, 2, 6, 4, 5, 3};
         tid = *((int*)a);
 
         rm_thread_started(tid); // Let the library know that thread is started
@@ -125,7 +125,7 @@ void* threadfunc0(void* a) {
 void* threadfunc1(void* a) {
     if (AVOID == 0) {
         int tid;
-        int request1[MAXR] = {3, 2, 0, 1, 2, 0};
+        int request1[NUMR] = {3, 2, 0, 1, 2, 0};
         tid = *((int*)a);
         
         rm_thread_started(tid); // Let the library know that thread is started
@@ -143,8 +143,8 @@ void* threadfunc1(void* a) {
     }
     else {
         int tid;
-        int request1[MAXR] = {2, 2, 1, 1, 2, 1};
-        int claim[MAXR] = {4, 3, 3, 2, 2, 1};
+        int request1[NUMR] = {2, 2, 1, 1, 2, 1};
+        int claim[NUMR] = {4, 3, 3, 2, 2, 1};
         tid = *((int*)a);
 
         rm_thread_started(tid); // Let the library know that thread is started
@@ -167,7 +167,7 @@ void* threadfunc1(void* a) {
 void* threadfunc2(void* a) {
     if (AVOID == 0) {
         int tid;
-        int request1[MAXR] = {2, 2, 1, 0, 1, 1};
+        int request1[NUMR] = {2, 2, 1, 0, 1, 1};
         tid = *((int*)a);
 
         rm_thread_started(tid); // Let the library know that thread is started
@@ -185,8 +185,8 @@ void* threadfunc2(void* a) {
     }
     else {
         int tid;
-        int request1[MAXR] = {2, 2, 1, 0, 1, 1};
-        int claim[MAXR] = {2, 3, 1, 1, 2, 3};
+        int request1[NUMR] = {2, 2, 1, 0, 1, 1};
+        int claim[NUMR] = {2, 3, 1, 1, 2, 3};
         tid = *((int*)a);
 
         
@@ -209,7 +209,7 @@ void* threadfunc2(void* a) {
 void* threadfunc3(void* a) {
     if (AVOID == 0) {
         int tid;
-        int request1[MAXR] = {1, 1, 1, 1, 2, 1};
+        int request1[NUMR] = {1, 1, 1, 1, 2, 1};
         tid = *((int*)a);
 
         rm_thread_started(tid); // Let the library know that thread is started
@@ -227,8 +227,8 @@ void* threadfunc3(void* a) {
     }
     else {
         int tid;
-        int request1[MAXR] = {0, 0, 0, 1, 0, 0};
-        int claim[MAXR] = {1, 1, 1, 1, 1, 1};
+        int request1[NUMR] = {0, 0, 0, 1, 0, 0};
+        int claim[NUMR] = {1, 1, 1, 1, 1, 1};
         tid = *((int*)a);
         
         rm_thread_started(tid); // Let the library know that thread is started
@@ -0,0 +1,415 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "rm.h"
+
+// Replays a trace recorded by rm_trace_start against the library
+// Each thread of the trace runs its own events, either as fast as possible or at the recorded pace, and
+// issues each one only after the events of all threads before it in the trace (by their seq), so the
+// grants of the recording are made again in the same order. A request that cannot be granted at once in
+// the replay (which only happens if the replay differs from the recording, e.g. in the other mode) lets
+// the next events go on while it waits, so the replay cannot hang on the order. In avoidance mode a thread that never claimed in the trace claims the most it held
+// at once, so a trace recorded in detection mode can be replayed in avoidance mode; claims are skipped in
+// detection mode. The result is printed as a single JSON object
+
+// One event of the trace
+struct event {
+    int type;
+    long long ns;
+    long long seq;
+    int *vec;
+};
+
+// Events of a thread in their recorded order
+struct thread_trace {
+    struct event *events;
+    long count;
+    long capacity;
+    int claimed;   // 1 if the trace has a claim of the thread
+    int *peak;     // most of each type the thread held at once
+    int *held;     // what the thread holds while the peak is computed
+    pthread_cond_t turn; // signaled when the next event to issue is one of the thread
+};
+
+// Global Variables
+int numThreads;
+int numTypes;
+int avoid = -1;          // -1: the mode of the trace
+int paced = 0;           // 1: run the events at the recorded pace
+int detectIntervalMs = 10; // period of rm_detection in detection mode
+
+struct thread_trace *traces;
+long long *requestLat;   // latencies of the requests in nanoseconds, in the order of the events
+long *requestBase;       // index of the first request of each thread in requestLat
+long long start;
+long failures = 0;
+pthread_mutex_t failureLock = PTHREAD_MUTEX_INITIALIZER;
+long long nextSeq = 0;   // seq of the next event to issue
+int *seqTid;             // thread of each event by its seq
+long long seqCount = 0;  // num of events
+long long seqCapacity = 0;
+pthread_mutex_t seqLock = PTHREAD_MUTEX_INITIALIZER;
+volatile int workersDone = 0;
+
+// Function Signatures
+void read_trace(const char *path, int *exist);
+void add_event(int tid, int type, long long ns, long long seq, int *vec);
+void wait_turn(int tid, long long seq);
+void pass_turn();
+void* worker(void*);
+void* detector(void*);
+void count_failure(int tid, int type, int ret);
+void sleep_until(long long ns);
+long long now_ns();
+int compare_ll(const void*, const void*);
+void print_percentiles(const char *name, long long *lat, long count);
+void usage();
+
+// Main Function
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:pd:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "avoid") == 0) {
+                avoid = 1;
+            }
+            else if (strcmp(optarg, "detect") == 0) {
+                avoid = 0;
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'p': paced = 1; break;
+        case 'd': detectIntervalMs = atoi(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (optind != argc - 1 || detectIntervalMs < 1) {
+        usage();
+    }
+
+    struct rm_trace_header header;
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || header.magic != RM_TRACE_MAGIC ||
+        header.n < 1 || header.m < 1) {
+        fprintf(stderr, "rmreplay: %s is not a trace\n", argv[optind]);
+        exit(1);
+    }
+    fclose(file);
+
+    numThreads = header.n;
+    numTypes = header.m;
+    if (avoid == -1) {
+        avoid = header.avoid;
+    }
+
+    int *exist = malloc(numTypes * sizeof(int));
+    int *tids = malloc(numThreads * sizeof(int));
+    pthread_t *threadArray = malloc(numThreads * sizeof(pthread_t));
+    traces = calloc(numThreads, sizeof(struct thread_trace));
+    requestBase = malloc((numThreads + 1) * sizeof(long));
+    if (exist == NULL || tids == NULL || threadArray == NULL || traces == NULL || requestBase == NULL) {
+        fprintf(stderr, "rmreplay: out of memory\n");
+        exit(1);
+    }
+
+    read_trace(argv[optind], exist);
+
+    // Room for the latency of each request
+    long events = 0;
+    requestBase[0] = 0;
+    for (int i = 0; i < numThreads; i++) {
+        long requests = 0;
+        for (long k = 0; k < traces[i].count; k++) {
+            requests += (traces[i].events[k].type == RM_TRACE_REQUEST);
+        }
+        requestBase[i + 1] = requestBase[i] + requests;
+        events += traces[i].count;
+    }
+    requestLat = malloc((requestBase[numThreads] + 1) * sizeof(long long));
+    if (requestLat == NULL) {
+        fprintf(stderr, "rmreplay: out of memory\n");
+        exit(1);
+    }
+
+    if (rm_init(numThreads, numTypes, exist, avoid) != 0) {
+        fprintf(stderr, "rmreplay: rm_init failed\n");
+        exit(1);
+    }
+
+    start = now_ns();
+
+    pthread_t detectorThread;
+    if (avoid == 0) {
+        pthread_create(&detectorThread, NULL, detector, NULL);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        tids[i] = i;
+        pthread_create(&threadArray[i], NULL, worker, &tids[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threadArray[i], NULL);
+    }
+
+    long long elapsed = now_ns() - start;
+
+    workersDone = 1;
+    if (avoid == 0) {
+        pthread_join(detectorThread, NULL);
+    }
+
+    struct rm_timing timing;
+    rm_get_timing(&timing);
+
+    struct rm_thread_stats *stats = malloc(numThreads * sizeof(struct rm_thread_stats));
+    long long blocks = 0, rollbacks = 0;
+    if (stats != NULL && rm_get_stats(stats, NULL) == 0) {
+        for (int i = 0; i < numThreads; i++) {
+            blocks += stats[i].blocks;
+            rollbacks += stats[i].rollbacks;
+        }
+    }
+    free(stats);
+
+    printf("{\"trace\":\"%s\",\"mode\":\"%s\",\"paced\":%d,\"threads\":%d,\"types\":%d,",
+           argv[optind], avoid ? "avoid" : "detect", paced, numThreads, numTypes);
+    printf("\"events\":%ld,\"failures\":%ld,\"elapsed_s\":%.6f,\"events_per_sec\":%.1f,",
+           events, failures, elapsed / 1e9, events / (elapsed / 1e9));
+    print_percentiles("request_ns", requestLat, requestBase[numThreads]);
+    printf(",\"blocks\":%lld", blocks);
+    printf(",\"safety_check\":{\"calls\":%lld,\"cached\":%lld,\"ns\":%lld,\"rollbacks\":%lld}",
+           timing.safety_calls, timing.safety_cached, timing.safety_ns, rollbacks);
+    printf(",\"detection\":{\"calls\":%lld,\"ns\":%lld}}\n", timing.detection_calls, timing.detection_ns);
+
+    return (failures == 0) ? 0 : 1;
+}
+
+// Reads the existing resources and the events of each thread from the trace
+void read_trace(const char *path, int *exist) {
+    FILE *file = fopen(path, "rb");
+    struct rm_trace_header header;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+        fread(exist, sizeof(int), numTypes, file) != (size_t) numTypes) {
+        fprintf(stderr, "rmreplay: cannot read %s\n", path);
+        exit(1);
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        traces[i].peak = calloc(numTypes, sizeof(int));
+        traces[i].held = calloc(numTypes, sizeof(int));
+        pthread_cond_init(&traces[i].turn, NULL);
+        if (traces[i].peak == NULL || traces[i].held == NULL) {
+            fprintf(stderr, "rmreplay: out of memory\n");
+            exit(1);
+        }
+    }
+
+    struct rm_trace_event event;
+    long long seq = 0;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        int *vec = malloc(numTypes * sizeof(int));
+        if (vec == NULL) {
+            fprintf(stderr, "rmreplay: out of memory\n");
+            exit(1);
+        }
+        if (fread(vec, sizeof(int), numTypes, file) != (size_t) numTypes ||
+            event.tid < 0 || event.tid >= numThreads || event.type < RM_TRACE_STARTED || event.type > RM_TRACE_ENDED ||
+            event.seq != seq++) {
+            fprintf(stderr, "rmreplay: %s is truncated or corrupt\n", path);
+            exit(1);
+        }
+        add_event(event.tid, event.type, event.ns, event.seq, vec);
+    }
+
+    fclose(file);
+}
+
+// Appends the event to the trace of the thread and follows what the thread holds
+void add_event(int tid, int type, long long ns, long long seq, int *vec) {
+    struct thread_trace *t = &traces[tid];
+
+    if (t->count == t->capacity) {
+        t->capacity = (t->capacity == 0) ? 64 : 2 * t->capacity;
+        t->events = realloc(t->events, t->capacity * sizeof(struct event));
+        if (t->events == NULL) {
+            fprintf(stderr, "rmreplay: out of memory\n");
+            exit(1);
+        }
+    }
+    t->events[t->count].type = type;
+    t->events[t->count].ns = ns;
+    t->events[t->count].seq = seq;
+    if (seqCount == seqCapacity) {
+        seqCapacity = (seqCapacity == 0) ? 64 : 2 * seqCapacity;
+        seqTid = realloc(seqTid, seqCapacity * sizeof(int));
+        if (seqTid == NULL) {
+            fprintf(stderr, "rmreplay: out of memory\n");
+            exit(1);
+        }
+    }
+    seqTid[seqCount++] = tid; // seq is the index of the event in the trace
+    t->events[t->count].vec = vec;
+    t->count++;
+
+    for (int j = 0; j < numTypes; j++) {
+        if (type == RM_TRACE_REQUEST) {
+            t->held[j] += vec[j];
+        }
+        else if (type == RM_TRACE_RELEASE && vec[j] <= t->held[j]) {
+            t->held[j] -= vec[j];
+        }
+        if (t->held[j] > t->peak[j]) {
+            t->peak[j] = t->held[j];
+        }
+    }
+    if (type == RM_TRACE_CLAIM) {
+        t->claimed = 1;
+    }
+}
+
+void* worker(void *a) {
+    int tid = *((int*) a);
+    struct thread_trace *t = &traces[tid];
+    long long *reqLat = requestLat + requestBase[tid];
+
+    for (long k = 0; k < t->count; k++) {
+        struct event *e = &t->events[k];
+        int ret = 0;
+        int passed = 0; // 1 once the next event may be issued
+
+        if (paced) {
+            sleep_until(start + e->ns);
+        }
+        wait_turn(tid, e->seq);
+
+        switch (e->type) {
+        case RM_TRACE_STARTED:
+            ret = rm_thread_started(tid);
+            if (ret == 0 && avoid && !t->claimed) {
+                ret = rm_claim(t->peak);
+            }
+            break;
+        case RM_TRACE_CLAIM:
+            if (avoid) {
+                ret = rm_claim(e->vec);
+            }
+            break;
+        case RM_TRACE_REQUEST: {
+            // A request that has to wait lets the next events go on, one of them may be the release it waits for
+            long long t0 = now_ns();
+            ret = rm_try_request(e->vec);
+            if (ret == EWOULDBLOCK) {
+                pass_turn();
+                passed = 1;
+                ret = rm_request(e->vec);
+            }
+            *reqLat++ = now_ns() - t0;
+            break;
+        }
+        case RM_TRACE_RELEASE:
+            ret = rm_release(e->vec);
+            break;
+        case RM_TRACE_ENDED:
+            ret = rm_thread_ended();
+            break;
+        }
+
+        if (!passed) {
+            pass_turn();
+        }
+        if (ret != 0) {
+            count_failure(tid, e->type, ret);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+// Waits until the events before seq of thread tid were issued
+void wait_turn(int tid, long long seq) {
+    pthread_mutex_lock(&seqLock);
+    while (nextSeq != seq) {
+        pthread_cond_wait(&traces[tid].turn, &seqLock);
+    }
+    pthread_mutex_unlock(&seqLock);
+}
+
+// Lets the next event be issued, waking only the thread it belongs to
+void pass_turn() {
+    pthread_mutex_lock(&seqLock);
+    nextSeq++;
+    if (nextSeq < seqCount) {
+        pthread_cond_signal(&traces[seqTid[nextSeq]].turn);
+    }
+    pthread_mutex_unlock(&seqLock);
+}
+
+// A replay that differs from the recording (a request that waits in the replay) may deadlock in detection mode
+void* detector(void *a) {
+    struct timespec interval = {detectIntervalMs / 1000, (detectIntervalMs % 1000) * 1000000L};
+
+    while (!workersDone) {
+        int count = rm_detection();
+        if (count > 0) {
+            fprintf(stderr, "rmreplay: deadlock of %d threads\n", count);
+            exit(2);
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    pthread_exit(NULL);
+}
+
+// Counts a call that did not succeed as it did when it was recorded, the first one is reported
+void count_failure(int tid, int type, int ret) {
+    static const char *calls[] = {"rm_thread_started", "rm_claim", "rm_request", "rm_release", "rm_thread_ended"};
+
+    pthread_mutex_lock(&failureLock);
+    if (failures++ == 0) {
+        fprintf(stderr, "rmreplay: %s of thread %d returned %d\n", calls[type], tid, ret);
+    }
+    pthread_mutex_unlock(&failureLock);
+}
+
+// Sleeps until the monotonic time ns
+void sleep_until(long long ns) {
+    struct timespec until = {ns / 1000000000LL, ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0) {
+    }
+}
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *((const long long*) a);
+    long long y = *((const long long*) b);
+    return (x > y) - (x < y);
+}
+
+// Prints "name":{"p50":..,"p99":..,"p999":..} of the latencies (sorts them)
+void print_percentiles(const char *name, long long *lat, long count) {
+    if (count == 0) {
+        printf("\"%s\":{\"p50\":0,\"p99\":0,\"p999\":0}", name);
+        return;
+    }
+    qsort(lat, count, sizeof(long long), compare_ll);
+    printf("\"%s\":{\"p50\":%lld,\"p99\":%lld,\"p999\":%lld}", name,
+           lat[(long) (0.5 * (count - 1))], lat[(long) (0.99 * (count - 1))], lat[(long) (0.999 * (count - 1))]);
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./rmreplay [-m avoid|detect] [-p] [-d detect-interval-ms] trace\n");
+    exit(1);
+}
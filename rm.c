@@ -1,664 +1,4663 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "rm.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#define CPU_PAUSE() _mm_pause()
+#elif defined(__aarch64__)
+#define CPU_PAUSE() __asm__ __volatile__("yield")
+#else
+#define CPU_PAUSE() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+#define CACHE_LINE 64 // size of a cache line in bytes
+#define LINE_INTS ((int) (CACHE_LINE / sizeof(int))) // num of ints in a cache line
+
+
+// State of a resource manager instance
+// Every function works on the instance given to it, so instances are independent and each has its own
+// locks; the functions without a context work on the default instance set up by rm_init
+
+// Scratch space of the reduction engine used by safety_check and rm_detection (only used while holding the mutex)
+struct block_entry {
+    int demand; // Amount of the resource type the thread still waits for
+    int thread; // User defined id of the blocked thread
+};
+
+// Adaptive waiting (RM_WAIT_ADAPTIVE)
+// A thread that finds a lock taken spins for a budget of about twice the spins such waits took recently and
+// only then parks on the futex of the lock word; a wait that outlasts the budget shrinks the estimate, so
+// threads stop spinning on locks that are held long. Waits for a grant spin and park the same way
+#define SPIN_MIN 16 // Spins of the budget even when the recent waits were long
+#define SPIN_MAX 4096 // Largest budget
+struct spin_lock {
+    atomic_int word; // 0 = Free, 1 = Held, 2 = Held and threads may be parked on it
+    atomic_int spins; // Estimate of the spins a wait for the lock takes
+};
+
+// Locks of the resource types used by detection mode (DA == 0)
+// In detection mode the Available entry and the Allocation column of a resource type are protected by the
+// lock of that type, so that requests and releases of disjoint resource types do not serialize on the
+// mutex; the mutex protects the rest of the state. Locks are always taken in increasing resource type
+// order, and the mutex is always taken before any of them
+struct res_lock {
+    pthread_mutex_t lock;
+    struct spin_lock spin; // Used instead of lock in adaptive wait mode
+    long long grants; // Statistics of the type, protected by the lock in detection mode and by the mutex in
+    long long units;  // avoidance mode, except blocks which is always protected by the mutex
+    long long blocks;
+    atomic_uint seq; // Odd while a thread holding the lock changes the state of the type (see StateSeq)
+} __attribute__((aligned(CACHE_LINE))); // Each lock on its own cache line
+
+// Statistics of each thread, each slot on its own cache lines so that a thread counting its own
+// operations does not contend with the others; counters of a thread waiting for a grant may also be
+// updated by the thread that checks its request, so they are updated with relaxed atomic adds
+struct thread_stats {
+    atomic_llong requests;
+    atomic_llong grants;
+    atomic_llong blocks;
+    atomic_llong emptyWakeups;
+    atomic_llong safetyChecks;
+    atomic_llong rollbacks;
+    atomic_llong blockedNs;
+    atomic_llong mutexHeldNs;
+    atomic_llong typeLockHeldNs;
+    atomic_llong aborts;
+} __attribute__((aligned(CACHE_LINE)));
+#define STAT_ADD(ctx, tid, field, value) atomic_fetch_add_explicit(&(ctx)->Stats[tid].field, (value), memory_order_relaxed)
+
+// Pool of worker threads that run the parts of a task of the parallel reduction (rm_set_parallel)
+// A task is posted by pool_run, whose caller runs part 0 while each helper thread runs one of the others
+struct rm_pool {
+    pthread_t *threads; // Helper threads (workers - 1)
+    int workers; // Num of parts of each task
+    pthread_mutex_t run; // Held by the reduction using the pool, since an instance and its copy share it
+    pthread_mutex_t lock; // Protects the fields below
+    pthread_cond_t start; // Signaled when a task is posted or the pool stops
+    pthread_cond_t done; // Signaled when the last helper finished its part
+    unsigned long gen; // Incremented by each posted task
+    int claimed; // Num of parts of the current task taken by the helpers
+    int pending; // Num of helpers still running their part
+    int stop; // Indicates if the helpers exit (1 = Stop)
+    void (*task)(struct rm_ctx *ctx, int part, int parts);
+    struct rm_ctx *ctx;
+};
+
+// Registry of the threads waiting in rm_request
+// Each waiting thread is in exactly one list: the list of a resource type it is short on, or the
+// unsafe list (index M) if all its requested resources are available but granting them is unsafe
+#define WAIT_UNSAFE(ctx) ((ctx)->M)
+
+// Segment of a process-shared instance (named shared memory, rm_create_shared) or of a persistent one (a
+// file, rm_open_file). The segment holds this header, the instance and all of its state, and it is mapped
+// at the same address in every process so that the pointers of the state are valid in all of them
+#define SHARED_MAGIC 0x53524d52 // "RMRS"
+#define SEGMENT_VERSION 2 // Changed whenever the meaning of the state in a segment changes
+struct rm_segment {
+    unsigned int magic;
+    unsigned int version; // SEGMENT_VERSION of the library that created the segment
+    atomic_int ready; // Set once the creator initialized the instance
+    size_t size; // Size of the segment in bytes
+    void *base; // Address the segment is mapped at
+    size_t used; // Bytes of the segment allocated so far
+    struct rm_ctx *ctx; // The instance
+    unsigned long long checksum; // Checksum of the header and of the configuration of the instance (segment_checksum)
+    int fd; // Open file of a persistent instance in the process hosting it, which holds its lock
+};
+
+#define REAP_INTERVAL 1 // Seconds between the checks for dead processes of a thread waiting on a shared instance
+
+#define SNAPSHOT_TRIES 64 // Optimistic copies rm_snapshot and rm_detection make before they take the locks
+
+struct rm_ctx {
+    int DA;  // indicates if deadlocks will be avoided or not
+    int N;   // number of processes (threads)
+    int M;   // number of resource types
+    int RowStride; // Num of ints between the rows of the matrices (M rounded up to whole cache lines)
+    int *StateBlock; // Cache line aligned block holding the vectors and the matrices contiguously
+    int **RowTable; // Row pointers of the matrices into StateBlock
+    int *ThreadFinish; // Indicates if a thread is finished or not (1 = Finished, 0 = Not Finished)
+    int *ExistingRes; // Existing resources vector
+    int *AvailableRes; // Available resources vector
+    int **AllocationMat; // Num of resources of each type allocated to each thread
+    int **RequestMat; // Num of resources that are requested by a thread
+    int **MaxDemandMat; // Max demand for each resource type for each thread
+    int **NeedMat; // Need for each resource type for each thread
+    pthread_t *threadList; // Each index represents the user defined thread id and the value represents the real id
+    pthread_key_t CallerKey; // User defined id + 1 bound to each thread by rm_thread_started (NULL if none)
+    unsigned long Serial; // Unique num of the instance, tags the ids cached by the threads
+
+    // Process-shared mode (rm_create_shared)
+    // The state of a shared instance is allocated from its segment and its locks are process shared and
+    // robust. Thread specific data is per process, so a thread finds the id it is bound to by Owner and
+    // threadList instead of CallerKey. When a process dies while holding a lock, the next thread to take the
+    // lock derives the available resources from the allocations again and ends the ids of dead processes
+    // A persistent instance (rm_open_file) is in a segment too, mapped from its file, but it is private to
+    // the one process hosting it
+    struct rm_segment *Segment; // Segment holding the instance (NULL unless it is shared or persistent)
+    int Shared; // Indicates if the instance is process shared (1 = Shared)
+    pid_t *Owner; // Process that started each id
+    int *Bound; // Indicates if an id is bound to a thread by rm_thread_started (1 = Bound)
+
+    // Journal of the grant in progress in try_grant (instances in a segment only), so that a grant its thread
+    // died in can be finished or undone: until the grant is decided the allocation row is restored from
+    // GrantAlloc, afterwards the request is completed
+    atomic_int GrantTid; // Thread whose request is being granted (-1 if none)
+    atomic_int GrantDecided; // Indicates if the grant is decided (1 = Decided)
+    int *GrantAlloc; // Allocation row of GrantTid before the grant (RowStride entries)
+
+    // Scratch space of the reduction engine
+    int *Work; // Resources that would be available as threads run to completion (padded to RowStride)
+    int *BlockIdx; // Resource types that block a thread (RowStride entries)
+    int *FinishTemp; // Threads that are finished or would run to completion
+    int *BlockCount; // Num of resource types that still block each thread
+    int *WorkList; // Threads that are no longer blocked and wait to be marked as finished
+    int *BlockStart; // Start of the entries of each resource type in BlockList (M + 1 entries)
+    int *BlockPos; // Next entry of each resource type to be checked against Work
+    struct block_entry *BlockList; // Blocked threads grouped by resource type, sorted by demand (N * M entries)
+
+    // Registry of the threads waiting in rm_request
+    pthread_cond_t *WaitCond; // condition variable for each thread, signaled when its request is granted
+    int *Waiting; // Indicates if a thread waits for its request to be granted (1 = Waiting, 0 = Not Waiting)
+    int *WaitOn; // List the waiting thread is in
+    int *WaitNext; // Next thread in the same list (-1 if last)
+    int *WaitPrev; // Previous thread in the same list (-1 if first)
+    int *WaitRound; // Last wake round the waiting thread was checked in
+    int *WaitHead; // First waiting thread of each list (-1 if empty, M + 1 entries)
+    int *WaitTail; // Last waiting thread of each list (-1 if empty, M + 1 entries)
+    int wakeRound; // Incremented by each call to wake_waiters
+
+    // Grant policy of the waiting requests
+    // Besides the wait lists, the waiting threads are kept in one list in the order the policy serves them.
+    // A waiting request is bypassed when a request that arrived after it is granted first; once it has
+    // been bypassed MaxBypass times, requests arriving after it are held back until it is granted, except
+    // the requests of threads holding resources, since the waiting request may need those resources
+    int Policy; // RM_POLICY_ANY, RM_POLICY_FIFO, RM_POLICY_PRIORITY or RM_POLICY_SMALLEST
+    int MaxBypass; // Num of bypasses a waiting request allows (-1 if unlimited)
+    atomic_int Ordered; // Indicates if the policy orders the grants (1 = Ordered, 0 = any fitting request)
+    int *Priority; // Priority of each thread set by rm_set_priority (higher is served first)
+    long long ArrivalSeq; // Incremented by each request that may wait
+    long long *Arrival; // Arrival of the current request of each thread
+    long long *ReqSize; // Num of requested resources of the current request of each thread
+    int *Bypass; // Num of times the waiting request of each thread was bypassed
+    int *OrderNext; // Next waiting thread in the policy order (-1 if last)
+    int *OrderPrev; // Previous waiting thread in the policy order (-1 if first)
+    int OrderHead; // First waiting thread in the policy order (-1 if none)
+    int OrderTail; // Last waiting thread in the policy order (-1 if none)
+    int *Skipped; // Scratch space of wake_ordered (N entries)
+
+    // Bound used by avoidance mode to grant requests without running the safety check
+    // NeedBound[j] is never less than the need of any unfinished thread for resource type j. If the
+    // resources left after a grant still cover NeedBound, every unfinished thread can run to completion
+    // on its own, so the new state is safe. Increases of a need raise the bound right away, decreases
+    // only mark it stale, and a stale bound is recomputed by the next full safety check
+    int *NeedBound; // Upper bound of the need of the unfinished threads for each resource type
+    int NeedBoundStale; // Indicates if a need decreased since NeedBound was computed (1 = Stale)
+
+    // Safe sequence found by the last full safety check (avoidance mode only)
+    // Grants and releases rarely change the order in which the threads can run to completion, so a safety
+    // check first replays the cached order against the new state in one pass; the full search only runs if
+    // a thread of the order cannot finish or an unfinished thread is missing from it
+    int *SafeSeq; // Unfinished threads in the order they ran to completion in the last full safety check
+    int SafeLen; // Num of threads in SafeSeq (0 if no order is cached)
+    long long SafeCached; // Num of safety checks passed by the cached order (only used while holding the mutex)
+
+    // Event driven deadlock detection (detection mode only)
+    // When a thread blocks, only the threads its progress depends on are checked: the threads holding a
+    // resource type it is short on, the threads those wait for if they are blocked too, and so on. Only
+    // if some of them are deadlocked is the full detection run to report the exact deadlocked set
+    int EventDetection; // Indicates if detection runs when a thread blocks (1 = Enabled)
+    rm_deadlock_handler DeadlockHandler; // Called with the deadlocked set when a deadlock is detected
+    void *DeadlockArg; // Argument passed to DeadlockHandler
+    int DeadlockFd; // eventfd signaled when a deadlock is detected (-1 if not created)
+    int *DeadlockIds; // Ids of the deadlocked threads found by the last detection
+    int *Visited; // Threads already added to the checked part of the wait-for graph
+    int *TypeSeen; // Resource types whose holders are already added to the checked part
+
+    // Deadlock recovery (detection mode only)
+    // Each time a deadlock is detected, victims are picked from the deadlocked set by the victim cost until
+    // the rest can run; the allocation of a victim returns to the available pool and its pending request
+    // fails with EDEADLK
+    int Recovery; // Indicates if deadlocks are recovered (1 = Enabled)
+    int VictimCost; // RM_VICTIM_FEWEST_HELD, RM_VICTIM_LOWEST_PRIORITY or RM_VICTIM_YOUNGEST
+    int *Aborted; // Indicates if the pending request of a thread was aborted by the recovery (1 = Aborted)
+    long long StartSeq; // Incremented by each rm_thread_started
+    long long *Started; // Value of StartSeq when each thread started
+    int *RecoverIds; // Deadlocked threads left after each victim (N entries)
+    int *Freed; // Resources returned by the victims of the last recovery (RowStride entries)
+
+    // Asynchronous requests (rm_request_async)
+    // Such a request waits in the lists like any other, but when its wait ends the result is queued for
+    // rm_async_poll instead of being returned to a waiting thread
+    int *Detached; // Indicates if the waiting request of a thread is detached (1 = Detached)
+    unsigned long long *Ticket; // Ticket of the last asynchronous request of each thread
+    unsigned long long TicketSeq; // Incremented by each asynchronous request
+    long long *AsyncAt; // Time of the last asynchronous request of each thread (trace_now)
+    int *AsyncReq; // Last asynchronous request of each thread, traced once granted (RowStride entries each)
+    int *DoneIds; // Threads whose detached requests completed, oldest first (ring of N entries)
+    int *DoneResult; // Result of each completed request (0 or EDEADLK)
+    int *DonePending; // Indicates if a completion of the thread is queued (1 = Queued)
+    int DoneHead; // Index of the oldest completion in the ring
+    int DoneCount; // Num of queued completions
+    int AsyncFd; // eventfd signaled when the completion queue becomes non-empty (-1 if not created)
+
+    // Batches (rm_batch)
+    // Each thread sums up the released and the requested resources of its batch and marks the touched
+    // resource types in its own 3 rows (RowStride entries each), so no lock is needed to fill them
+    int *BatchScratch;
+
+    // Parallel reduction of large instances (rm_set_parallel)
+    // Once N * M reaches ParallelMin, reduce runs in rounds instead: the workers of Pool test their share of
+    // the candidate threads against Work, the threads that fit are marked as finished, and their allocation
+    // is added to Work by ranges of resource types. The maximal set of finishable threads, and so the
+    // result, is the same as the one of the serial engine
+    struct rm_pool *Pool; // Workers of the reduction, shared with DetectCopy (NULL if serial)
+    long ParallelMin; // Least N * M that is reduced in parallel
+    int *ParCand; // Threads that are not finished yet (N entries)
+    int *ParFits; // Indicates if each candidate fits in Work in the current round (N entries)
+    int ParCount; // Num of candidates
+    int ParDone; // Num of threads finished in the current round (in WorkList)
+    int **ParDemand; // Demand of the reduction in progress
+
+    struct res_lock *ResLock; // Lock of each resource type
+    atomic_int NumWaiters; // Num of threads in the slow path of rm_request in detection mode
+
+    pthread_mutex_t mutex; // single mutex lock
+
+    // Adaptive wait mode (rm_set_wait_mode), never used by a shared instance
+    // The mutex and the locks of the resource types are spin locks, and a thread waiting for a grant spins on
+    // its WakeSeq before parking on it; Parked lets the thread granting the request skip the futex wake
+    int WaitMode; // RM_WAIT_BLOCK or RM_WAIT_ADAPTIVE
+    int SpinMax; // Largest spin budget (0 if there is a single CPU, so spinning cannot help)
+    struct spin_lock SpinMutex; // Used instead of mutex in adaptive wait mode
+    atomic_int WaitSpins; // Estimate of the spins a wait for a grant takes
+    atomic_int *WakeSeq; // Incremented when the waiting request of each thread is granted or aborted
+    atomic_int *Parked; // Indicates if each thread may be parked on its WakeSeq (1 = Parked)
+
+    // Sequence counters that let rm_snapshot copy the state without taking the locks
+    // StateSeq is odd while a thread holds the mutex and the seq of each resource type is odd while a thread
+    // holds its lock outside the mutex; a copy made while all of them stayed the same even values is consistent
+    atomic_uint StateSeq;
+
+    struct thread_stats *Stats; // Statistics of each thread
+    atomic_int StatsTiming; // Indicates if the time threads hold the locks is measured (1 = Enabled)
+
+    // Time spent in safety_check (only used while holding the mutex) and in the deadlock detection
+    long long SafetyCalls;
+    long long SafetyNs;
+    atomic_llong DetectionCalls;
+    atomic_llong DetectionNs;
+
+    // rm_detection runs on a copy of the state in a second instance, so it holds no lock of this one while
+    // it scans; DetectLock serializes the detections that use the copy and is taken before the mutex
+    struct rm_ctx *DetectCopy; // Instance holding the copy (NULL until the first rm_detection)
+    pthread_mutex_t DetectLock;
+    unsigned int *DetectSeqs; // Sequence counters the copy was made at (M + 1 entries, used under DetectLock)
+
+    // Trace of the calls recorded by rm_trace_start
+    atomic_int Tracing; // Indicates if a trace is being recorded (1 = Recording)
+    FILE *Trace; // File the events are appended to (NULL if none)
+    long long TraceStart; // Time the recording started, event times are relative to it
+    long long TraceSeq; // Seq of the next event
+    pthread_mutex_t TraceLock; // Serializes the writes to the trace
+};
 
 // global variables
 
-int DA;  // indicates if deadlocks will be avoided or not
-int N;   // number of processes (threads)
-int M;   // number of resource types
-int ThreadFinish[MAXP]; // Indicates if a thread is finished or not (1 = Finished, 0 = Not Finished)
-int ExistingRes[MAXR]; // Existing resources vector
-int AvailableRes[MAXR]; // Available resources vector
-int AllocationMat[MAXP][MAXR]; // Num of resources of each type allocated to each thread 
-int RequestMat[MAXP][MAXR]; // Num of resources that are requested by a thread 
-int MaxDemandMat[MAXP][MAXR]; // Max demand for each resource type for each thread 
-int NeedMat[MAXP][MAXR]; // Need for each resource type for each thread 
-pthread_t threadList[MAXP]; // Each index represents the user defined thread id and the value represents the real id
-
-pthread_mutex_t mutex; // single mutex lock
-pthread_cond_t cond; // condition variable for each thread
+struct rm_ctx *DefaultCtx = NULL; // Instance used by the functions without a context
+atomic_ulong NextSerial = 1; // Serial of the next instance
+atomic_int NextWaitMode = RM_WAIT_BLOCK; // Wait mode of the instances created next (rm_set_wait_mode)
+pthread_once_t KernelsOnce = PTHREAD_ONCE_INIT; // Sets Vec once for all the instances (select_kernels)
+__thread unsigned long callerSerial = 0; // Serial of the instance callerId was looked up in
+__thread int callerId = -1; // User defined id of the calling thread in that instance (-1 if none)
+__thread long long mutexLockedAt = 0; // Time the calling thread took the mutex (0 if not timed)
+__thread long long typesLockedAt = 0; // Time the calling thread took resource type locks (0 if not timed)
 
 // end of global variables
 
+// Vector kernels used by the inner loops of the safety check, the detection and the grants
+// Each kernel has a scalar version and, on x86, SSE4.1 and AVX2 versions; select_kernels picks the
+// best one the CPU supports. Rows are padded with zeros up to RowStride, so kernels running over
+// whole padded rows give the same result as over the first M entries
+struct vec_kernels {
+    int (*le)(const int *a, const int *b, int n); // returns 1 if a[i] <= b[i] for every i, 0 otherwise
+    int (*gt_index)(const int *a, const int *b, int n, int out[]); // stores each i with a[i] > b[i] in out, returns their num
+    int (*nonzero)(const int *a, int n); // returns 1 if some a[i] != 0, 0 otherwise
+    void (*add)(int *dst, const int *src, int n); // dst[i] += src[i]
+    void (*sub)(int *dst, const int *src, int n); // dst[i] -= src[i]
+    void (*max)(int *dst, const int *src, int n); // dst[i] = max(dst[i], src[i])
+};
+struct vec_kernels Vec;
+
+// How do_request waits for the resources
+#define REQUEST_BLOCK 0 // Wait until the request is granted
+#define REQUEST_TRY 1 // Do not wait
+#define REQUEST_TIMED 2 // Wait until the request is granted or the deadline passes
+#define REQUEST_DETACHED 3 // Leave the request waiting and queue its result when the wait ends
+
 // Extra function signatures
-int safety_check();
+int safety_check(struct rm_ctx *ctx);
+long long clock_ns();
+void lock_mutex(struct rm_ctx *ctx);
+void unlock_mutex(struct rm_ctx *ctx);
+void mutex_hold_begin(struct rm_ctx *ctx);
+void mutex_hold_end(struct rm_ctx *ctx);
+void count_grant(struct rm_ctx *ctx, int request[]);
+void copy_state(struct rm_ctx *ctx, void *dst);
+void copy_detection_state(struct rm_ctx *ctx, void *dst);
+int read_consistent(struct rm_ctx *ctx, void (*copy)(struct rm_ctx *ctx, void *dst), void *dst, unsigned int seqs[]);
+int detect_copy(struct rm_ctx *ctx, int tids[]);
+unsigned int *snapshot_seqs(struct rm_snapshot *snap);
+void print_vector(const char *name, const int vec[], int m);
+void print_matrix(const char *name, const int mat[], int n, int m);
+int reduce(struct rm_ctx *ctx, int **Demand, int Finish[], int order[]);
+int check_safe_seq(struct rm_ctx *ctx, int unfinished);
+int reduce_parallel(struct rm_ctx *ctx, int **Demand, int Finish[], int order[]);
+void par_test(struct rm_ctx *ctx, int part, int parts);
+void par_merge(struct rm_ctx *ctx, int part, int parts);
+struct rm_pool *pool_create(int workers);
+void pool_destroy(struct rm_pool *pool);
+void pool_run(struct rm_pool *pool, struct rm_ctx *ctx, void (*task)(struct rm_ctx *ctx, int part, int parts));
+void *pool_helper(void *arg);
+int alloc_state(struct rm_ctx *ctx, int n, int m);
+int setup_instance(struct rm_ctx *ctx, int p_count, int r_count, int r_exist[], int avoid);
+void init_locks(struct rm_ctx *ctx);
+struct rm_ctx *create_detect_copy(struct rm_ctx *ctx);
+void *segment_alloc(struct rm_segment *seg, size_t size);
+void *state_malloc(struct rm_ctx *ctx, size_t size);
+void *state_calloc(struct rm_ctx *ctx, size_t count, size_t size);
+int state_memalign(struct rm_ctx *ctx, void **block, size_t size);
+void state_free(struct rm_ctx *ctx, void *p);
+struct rm_segment *map_segment(int fd, size_t size, void *addr, int fixed);
+struct rm_ctx *create_segment(int fd, const char *name, int p_count, int r_count, int r_exist[], int avoid, int shared);
+struct rm_segment *attach_segment(int fd);
+int segment_holds(struct rm_segment *seg, const void *p, size_t size);
+unsigned long long segment_checksum(struct rm_segment *seg);
+unsigned long long checksum_add(unsigned long long sum, const void *data, size_t size);
+struct rm_ctx *adopt_instance(struct rm_segment *seg, int p_count, int r_count, int r_exist[], int avoid);
+int check_layout(struct rm_ctx *ctx);
+int check_state(struct rm_ctx *ctx);
+void init_wait_cond(struct rm_ctx *ctx, int tid);
+int lock_robust(pthread_mutex_t *m);
+void unlock_type(struct rm_ctx *ctx, int j);
+void spin_lock(struct rm_ctx *ctx, struct spin_lock *lock);
+void spin_unlock(struct spin_lock *lock);
+int spin_budget(struct rm_ctx *ctx, int estimate);
+int spin_wait(struct rm_ctx *ctx, int tid, const struct timespec *until);
+void wake_thread(struct rm_ctx *ctx, int tid);
+int futex_wait(atomic_int *word, int value, const struct timespec *until);
+void futex_wake(atomic_int *word, int count);
+void lock_type(struct rm_ctx *ctx, int j);
+void mutex_acquired(struct rm_ctx *ctx, int ownerDied);
+void repair_state(struct rm_ctx *ctx);
+int apply_journal(struct rm_ctx *ctx);
+void derive_state(struct rm_ctx *ctx);
+int reap_dead(struct rm_ctx *ctx);
+int find_bound(struct rm_ctx *ctx);
+int process_gone(pid_t pid);
+void journal_begin(struct rm_ctx *ctx, int tid);
+void journal_decided(struct rm_ctx *ctx);
+void journal_end(struct rm_ctx *ctx);
+void free_state(struct rm_ctx *ctx);
+int take_resources(struct rm_ctx *ctx, int tid, int request[]);
+int take_locked(struct rm_ctx *ctx, int tid, int request[]);
+int release_resources(struct rm_ctx *ctx, int tid, int release[]);
+void lock_types(struct rm_ctx *ctx, int vec[]);
+void unlock_types(struct rm_ctx *ctx, int vec[]);
+void lock_all_types(struct rm_ctx *ctx);
+void unlock_all_types(struct rm_ctx *ctx);
+int caller_id(struct rm_ctx *ctx);
+int try_grant(struct rm_ctx *ctx, int tid);
+int fits_need_bound(struct rm_ctx *ctx, int tid);
+void raise_need_bound(struct rm_ctx *ctx, int tid);
+void wait_enqueue(struct rm_ctx *ctx, int tid, int list);
+void wait_unlink(struct rm_ctx *ctx, int tid);
+void wake_list(struct rm_ctx *ctx, int list);
+void wake_waiters(struct rm_ctx *ctx, int released[]);
+void wake_ordered(struct rm_ctx *ctx);
+void grant_waiter(struct rm_ctx *ctx, int tid);
+void order_key(struct rm_ctx *ctx, int tid);
+int order_before(struct rm_ctx *ctx, int a, int b);
+void order_insert(struct rm_ctx *ctx, int tid);
+void order_remove(struct rm_ctx *ctx, int tid);
+int held_back(struct rm_ctx *ctx, int tid);
+void count_bypass(struct rm_ctx *ctx);
+long long oldest_at_limit(struct rm_ctx *ctx);
+void select_kernels();
+void init_kernels();
+long long trace_now(struct rm_ctx *ctx);
+void trace_event(struct rm_ctx *ctx, int type, int tid, const int vec[], long long at);
+int do_started(struct rm_ctx *ctx, int tid, int bound);
+void do_ended(struct rm_ctx *ctx, int tid);
+int do_claim(struct rm_ctx *ctx, int tid, int claim[]);
+int do_release(struct rm_ctx *ctx, int tid, int release[]);
+int do_request(struct rm_ctx *ctx, int tid, int request[], int how, const struct timespec *deadline);
+int wait_granted(struct rm_ctx *ctx, int tid, int waitList, int how, const struct timespec *deadline);
+int detect_all(struct rm_ctx *ctx, int tids[]);
+int detect_from(struct rm_ctx *ctx, int tid);
+void report_deadlock(struct rm_ctx *ctx, int count);
+int recover(struct rm_ctx *ctx, int tids[], int count);
+void complete_detached(struct rm_ctx *ctx, int tid, int result);
+int async_idle(struct rm_ctx *ctx, int tid);
+int victim_before(struct rm_ctx *ctx, int a, int b);
 
 // Functions
 
-int rm_thread_started(int tid)
+int rm_thread_started_ctx(struct rm_ctx *ctx, int tid)
 {
-    /* Critical section starts here */
-    pthread_mutex_lock(&mutex);
-
-    if ((tid < 0) || (tid >= N)) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
-
+    if (ctx == NULL || do_started(ctx, tid, 1) == -1) {
         return -1;
     }
 
-    threadList[tid] = pthread_self(); // assign the real thread_id
-    ThreadFinish[tid] = 0; // Thread is started fo mark it as not finished
-
-    /* critical section end */
-	pthread_mutex_unlock(&mutex);
+    // Bind the user defined id to the calling thread so later calls find it without a scan
+    if (ctx->Shared == 0) {
+        pthread_setspecific(ctx->CallerKey, (void *) (intptr_t) (tid + 1));
+    }
+    callerSerial = ctx->Serial;
+    callerId = tid;
     
     return 0;
 }
 
-int rm_thread_ended()
+int rm_thread_ended_ctx(struct rm_ctx *ctx)
 {
-    /* Critical section starts here */
-    pthread_mutex_lock(&mutex);
-
     // find the user defined thread_id
-    int user_defined_id = -1;
-    for (int i = 0; i < N; i++) {
-        if (threadList[i] == pthread_self()) {
-            user_defined_id = i;
-        }
-    }
+    int user_defined_id = caller_id(ctx);
 
     // Conditions that the function has an error
     if (user_defined_id == -1) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
-
         return -1;
     }
 
-    ThreadFinish[user_defined_id] = 1; // Thread is ended so mark it as finished
+    if (ctx->Shared == 0) {
+        pthread_setspecific(ctx->CallerKey, NULL); // The calling thread no longer acts as this id
+    }
+    callerId = -1;
 
-    /* critical section end */
-	pthread_mutex_unlock(&mutex);
+    do_ended(ctx, user_defined_id);
 
     return 0;
 }
 
-int rm_claim (int claim[])
+int rm_claim_ctx(struct rm_ctx *ctx, int claim[])
 {
-    /* Critical section starts here */
-    pthread_mutex_lock(&mutex);
-
     // If deadlock avoidance will not be used (the detection will be used) then this function is not applicable
-    if (DA == 0) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
-
+    if (ctx == NULL || ctx->DA == 0) {
         return -1;
     }
 
     // Find the user defined thread_id
-    int user_defined_id = -1;
-    for (int i = 0; i < N; i++) {
-        if (threadList[i] == pthread_self()) {
-            user_defined_id = i;
-        }
-    }
+    int user_defined_id = caller_id(ctx);
 
     // Conditions that the function has an error
     if (user_defined_id == -1) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
-
         return -1;
     }
 
-    // Succesfully populate the max demand info for the specified thread if the demand is not more than existing
-    for (int i = 0; i < M; i++) {
-        if (claim[i] > ExistingRes[i]) {
-            /* critical section end */
-	        pthread_mutex_unlock(&mutex);
+    return do_claim(ctx, user_defined_id, claim);
+}
 
-            return -1;
+// There is no synchronization needed in this function since no other thread can use the instance before it is returned
+struct rm_ctx *rm_create(int p_count, int r_count, int r_exist[], int avoid)
+{
+    // Return NULL if invalid
+    if (p_count < 1 || r_count < 1) {
+        return NULL;
+    }
+    for (int i = 0; i < r_count; i++) {
+        if (r_exist[i] < 0) {
+            return NULL;
         }
-        MaxDemandMat[user_defined_id][i] = claim[i];
-        NeedMat[user_defined_id][i] = MaxDemandMat[user_defined_id][i];
     }
 
-    /* critical section end */
-	pthread_mutex_unlock(&mutex);
-    
-    return 0;
+    select_kernels();
+
+    struct rm_ctx *ctx = calloc(1, sizeof(struct rm_ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (pthread_key_create(&ctx->CallerKey, NULL) != 0) {
+        free(ctx);
+        return NULL;
+    }
+
+    if (setup_instance(ctx, p_count, r_count, r_exist, avoid) == -1) {
+        pthread_key_delete(ctx->CallerKey);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
 }
 
-// There is no synchronization needed in this function since only the main thread will call this function before any other thread is created
-int rm_init(int p_count, int r_count, int r_exist[],  int avoid)
+// Initializes the state of a zero filled instance, in its segment if it is shared
+// returns 0 on success, -1 if the memory could not be allocated
+int setup_instance(struct rm_ctx *ctx, int p_count, int r_count, int r_exist[], int avoid)
 {
-    DA = avoid;
-    N = p_count;
-    M = r_count;
-
-    // Return -1 if invalid
-    if (N > MAXP || N < 1 || M > MAXR || M < 1) {
+    // Allocate the vectors and matrices at their real size (they are zero filled)
+    if (alloc_state(ctx, p_count, r_count) == -1) {
         return -1;
     }
 
+    ctx->DA = (avoid != 0) ? 1 : 0;
+    ctx->N = p_count;
+    ctx->M = r_count;
+
+    // Serials of shared instances have the top bit set, so they differ from the serials of private ones
+    if (ctx->Shared == 0) {
+        ctx->Serial = atomic_fetch_add(&NextSerial, 1);
+    }
+    else {
+        ctx->Serial = (1UL << 63) | (((unsigned long) getpid() << 32) ^ (unsigned long) clock_ns());
+    }
+
     // initialize Existing and Available vectors
-    for (int i = 0; i < M; i++) {
-        // Return -1 if invalid
-        if (r_exist[i] < 0) {
-            return -1;
-        }
+    for (int i = 0; i < ctx->M; i++) {
+        ctx->ExistingRes[i] = r_exist[i];
+        ctx->AvailableRes[i] = r_exist[i];
+    }
 
-        ExistingRes[i] = r_exist[i];
-        AvailableRes[i] = r_exist[i];
+    // Allocation, max demand, request and need matrices start as 0
+    for (int i = 0; i < ctx->N; i++) {
+        ctx->ThreadFinish[i] = 1; // Initially there is no active thread so mark all as finished
+        ctx->Waiting[i] = 0;
+        ctx->WaitRound[i] = 0;
+        init_wait_cond(ctx, i);
     }
-    
-    // Initialize allocation, max demand, and request matrices to 0
-    for (int i = 0; i < N; i++) {
-        for (int j = 0; j < M; j++) {
-            AllocationMat[i][j] = 0;
-            MaxDemandMat[i][j] = 0;
-            RequestMat[i][j] = 0;
-            NeedMat[i][j] = 0;
-        }
 
-        ThreadFinish[i] = 1; // Initially there is no active thread so mark all as finished
+    // Initially no thread waits
+    for (int j = 0; j <= WAIT_UNSAFE(ctx); j++) {
+        ctx->WaitHead[j] = -1;
+        ctx->WaitTail[j] = -1;
     }
+    ctx->OrderHead = -1;
+    ctx->OrderTail = -1;
+    ctx->Policy = RM_POLICY_ANY;
+    ctx->MaxBypass = -1;
+    atomic_store(&ctx->Ordered, 0);
 
-    // Initialize mutex and condition variables
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&cond, NULL);
-    
-    return 0;
-}
+    init_locks(ctx);
+    for (int j = 0; j < ctx->M; j++) {
+        ctx->ResLock[j].grants = ctx->ResLock[j].units = ctx->ResLock[j].blocks = 0;
+    }
+    atomic_store(&ctx->NumWaiters, 0);
+    ctx->NeedBoundStale = 0; // NeedBound starts as 0 like the needs
+    ctx->SafetyCalls = ctx->SafetyNs = 0;
+    ctx->SafeLen = 0; // No order is cached until the first full safety check
+    atomic_store(&ctx->GrantTid, -1);
+    ctx->SafeCached = 0;
+    atomic_store(&ctx->DetectionCalls, 0);
+    atomic_store(&ctx->DetectionNs, 0);
+    ctx->DetectCopy = NULL;
+    atomic_store(&ctx->StatsTiming, 0);
 
+    // Event driven detection is off until a handler or the notification fd is requested
+    ctx->EventDetection = 0;
+    ctx->DeadlockHandler = NULL;
+    ctx->DeadlockArg = NULL;
+    ctx->DeadlockFd = -1;
+    ctx->AsyncFd = -1;
 
-int rm_request (int request[])
-{
-    /* critical section start */
-	pthread_mutex_lock(&mutex);
+    // No trace is recorded until rm_trace_start
+    atomic_store(&ctx->Tracing, 0);
+    ctx->Trace = NULL;
 
-    // Find the user defined id of the calling thread
-    int user_defined_id = -1;
-    for (int i = 0; i < N; i++) {
-        if (threadList[i] == pthread_self()) {
-            user_defined_id = i;
+    // Each process would create its own copy, which the others cannot reach, so a shared one is made now
+    if (ctx->Shared == 1) {
+        ctx->DetectCopy = create_detect_copy(ctx);
+        if (ctx->DetectCopy == NULL) {
+            free_state(ctx);
+            return -1;
         }
     }
 
-    // Conditions that the function has an error
-    if (user_defined_id == -1) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+    return 0;
+}
 
-        return -1;
+// Initializes the mutex, the locks of the resource types and the locks of the detection and the trace,
+// robust and process shared for a shared instance, in the wait mode selected by rm_set_wait_mode
+void init_locks(struct rm_ctx *ctx) {
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init(&mutexAttr);
+    if (ctx->Shared == 1) {
+        pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
     }
 
-    // Return error if the requested resources are more than the existing ones
-    for (int i = 0; i < M; i++) {
-        if (request[i] > ExistingRes[i]) {
-            /* critical section end */
-	        pthread_mutex_unlock(&mutex);
+    pthread_mutex_init(&ctx->mutex, &mutexAttr);
+    for (int j = 0; j < ctx->M; j++) {
+        pthread_mutex_init(&ctx->ResLock[j].lock, &mutexAttr);
+        atomic_store(&ctx->ResLock[j].seq, 0);
+    }
+    pthread_mutex_init(&ctx->DetectLock, &mutexAttr);
+    pthread_mutex_init(&ctx->TraceLock, &mutexAttr);
+    atomic_store(&ctx->StateSeq, 0);
 
-            return -1;
-        }
+    pthread_mutexattr_destroy(&mutexAttr);
+
+    // The spin locks of the adaptive wait mode, which a shared instance does not use since they are not robust
+    ctx->WaitMode = (ctx->Shared == 0) ? atomic_load(&NextWaitMode) : RM_WAIT_BLOCK;
+    ctx->SpinMax = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SPIN_MAX : 0;
+    atomic_store(&ctx->SpinMutex.word, 0);
+    atomic_store(&ctx->SpinMutex.spins, 0);
+    for (int j = 0; j < ctx->M; j++) {
+        atomic_store(&ctx->ResLock[j].spin.word, 0);
+        atomic_store(&ctx->ResLock[j].spin.spins, 0);
     }
+    atomic_store(&ctx->WaitSpins, 0);
+    for (int i = 0; i < ctx->N; i++) {
+        atomic_store(&ctx->Parked[i], 0);
+    }
+}
 
-    // If there is no avoidance then just allocate the resources when available
-    if (DA == 0) {
-        for (int j = 0; j < M; j++) {
-            RequestMat[user_defined_id][j] = request[j]; // Fill the request matrix
+// Creates an instance in the named shared memory segment
+struct rm_ctx *rm_create_shared(const char *name, int p_count, int r_count, int r_exist[], int avoid)
+{
+    // Return NULL if invalid
+    if (name == NULL || p_count < 1 || r_count < 1) {
+        return NULL;
+    }
+    for (int i = 0; i < r_count; i++) {
+        if (r_exist[i] < 0) {
+            return NULL;
         }
+    }
 
-        // Check if there is enough evailable resources
-        for (int i = 0; i < M; i++) {
-            if (RequestMat[user_defined_id][i] > AvailableRes[i]) {
-                pthread_cond_wait(&cond, &mutex); // If there is an unavailable resource, wait
-                i = -1; // After wake up from the wait, go back and check all resources again
-            }
-        }
+    select_kernels();
 
-        // If the thread is here, then we are sure there are available resources
-        // Go to new state
-        for (int i = 0; i < M; i++) {
-            AvailableRes[i] = AvailableRes[i] - request[i];
-            AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] + request[i];
-            RequestMat[user_defined_id][i] = 0; // Request is completed
-        }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
 
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+    struct rm_ctx *ctx = create_segment(fd, name, p_count, r_count, r_exist, avoid, 1);
 
-        return 0; // Return with success
+    close(fd);
+    if (ctx == NULL) {
+        shm_unlink(name);
     }
 
-    // Populate the need vector for the current thread
-    for (int i = 0; i < M; i++) {
-        NeedMat[user_defined_id][i] = MaxDemandMat[user_defined_id][i] - AllocationMat[user_defined_id][i];
-        RequestMat[user_defined_id][i] = request[i];
+    return ctx;
+}
 
-        // Check if the request is smaller than the need for the process
-        if (RequestMat[user_defined_id][i] > NeedMat[user_defined_id][i]) {
-            /* critical section end */
-	        pthread_mutex_unlock(&mutex);
+// Attaches the instance in the named shared memory segment; returns NULL if there is none (errno EINVAL if
+// the segment holds something else), if it is not initialized yet (errno EAGAIN) or if its address is
+// taken in this process (errno EADDRINUSE)
+struct rm_ctx *rm_open_shared(const char *name)
+{
+    if (name == NULL) {
+        return NULL;
+    }
 
-            return -1; // If the thread requests more resource than its max then there is an error 
-        }
-    } // Initialization and checks are done for deadlock avoidance
+    select_kernels();
 
-    // Check if there is enough available resources
-    for (int i = 0; i < M; i++) {
-        if (RequestMat[user_defined_id][i] > AvailableRes[i]) {
-            pthread_cond_wait(&cond, &mutex); // If there is an unavailable resource, wait
-            i = -1; // After wake up from the wait, go back and check all resources again
-        }
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
     }
-    // If the thread is here, then we are sure there are available resources
 
-    // Pretend to go into the new state
-    for (int i = 0; i < M; i++) {
-        AvailableRes[i] = AvailableRes[i] - RequestMat[user_defined_id][i];
-        AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] + RequestMat[user_defined_id][i];
-        NeedMat[user_defined_id][i] = NeedMat[user_defined_id][i] - RequestMat[user_defined_id][i];
+    struct rm_segment *seg = attach_segment(fd);
+    close(fd);
+    if (seg == NULL) {
+        return NULL;
     }
 
-    // Running the safety check algorithm on new state
-    int isSafeState;
-    isSafeState = safety_check();
+    // Ids of processes that died while not holding a lock are only found here
+    struct rm_ctx *ctx = seg->ctx;
+    /* Critical section starts here */
+    lock_mutex(ctx);
 
-    // If error occured in safety_check
-    if (isSafeState == -1) {
-        // Roll back to old state
-        for (int i = 0; i < M; i++) {
-            AvailableRes[i] = AvailableRes[i] + RequestMat[user_defined_id][i];
-            AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] - RequestMat[user_defined_id][i];
-            NeedMat[user_defined_id][i] = NeedMat[user_defined_id][i] + RequestMat[user_defined_id][i];
-            RequestMat[user_defined_id][i] = 0;
-        }
+    reap_dead(ctx);
 
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return ctx;
+}
 
+int rm_unlink_shared(const char *name)
+{
+    if (name == NULL || shm_unlink(name) == -1) {
         return -1;
     }
-    
 
-    while (safety_check() != 1) {
-        // Roll back to old state
-        for (int i = 0; i < M; i++) {
-            AvailableRes[i] = AvailableRes[i] + RequestMat[user_defined_id][i];
-            AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] - RequestMat[user_defined_id][i];
-            NeedMat[user_defined_id][i] = NeedMat[user_defined_id][i] + RequestMat[user_defined_id][i];
+    return 0;
+}
+
+// Opens the persistent instance in the file path, adopting the instance the file holds or creating the
+// file if it is new; the file stays locked until rm_destroy so that one process hosts it at a time
+// returns NULL if another process hosts it (errno EWOULDBLOCK), if the file holds something else or an
+// instance of another configuration (errno EINVAL) or if the state it holds is inconsistent (errno EBADMSG)
+struct rm_ctx *rm_open_file(const char *path, int p_count, int r_count, int r_exist[], int avoid)
+{
+    // Return NULL if invalid
+    if (path == NULL || p_count < 1 || r_count < 1) {
+        return NULL;
+    }
+    for (int i = 0; i < r_count; i++) {
+        if (r_exist[i] < 0) {
+            return NULL;
         }
+    }
+
+    select_kernels();
 
-        pthread_cond_wait(&cond, &mutex); // Wait until a signal
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        return NULL;
+    }
 
-        // Pretend to go into the new state again to confirm the new state is safe
-        for (int i = 0; i < M; i++) {
-            AvailableRes[i] = AvailableRes[i] - RequestMat[user_defined_id][i];
-            AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] + RequestMat[user_defined_id][i];
-            NeedMat[user_defined_id][i] = NeedMat[user_defined_id][i] - RequestMat[user_defined_id][i];
+    struct rm_ctx *ctx = NULL;
+    struct stat st;
+    int create = (fstat(fd, &st) == 0 && st.st_size == 0);
+    if (!create) {
+        struct rm_segment *seg = attach_segment(fd);
+        create = (seg == NULL && errno == EAGAIN); // The process creating the file ended before it was set up
+        if (seg != NULL) {
+            ctx = adopt_instance(seg, p_count, r_count, r_exist, avoid);
+            if (ctx == NULL) {
+                int err = errno;
+                munmap(seg, seg->size);
+                errno = err;
+            }
         }
     }
 
-    // If we are here then it is safe to go to next state
-    for (int i = 0; i < M; i++) {
-        RequestMat[user_defined_id][i] = 0; // Request is completed
+    if (create) {
+        ctx = create_segment(fd, path, p_count, r_count, r_exist, avoid, 0);
+        if (ctx != NULL && pthread_key_create(&ctx->CallerKey, NULL) != 0) {
+            munmap(ctx->Segment, ctx->Segment->size);
+            ctx = NULL;
+        }
+        if (ctx != NULL) {
+            msync(ctx->Segment, ctx->Segment->size, MS_SYNC);
+        }
     }
 
-    /* critical section end */
-    pthread_mutex_unlock(&mutex);
-    return 0;
+    if (ctx == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    ctx->Segment->fd = fd;
+    return ctx;
 }
 
+// Sets up an instance in a segment of the file fd, which is sized for the instance by doubling its size
+// until the state fits (pages that are never written take no memory); the instance is process shared if
+// shared is 1
+// returns the instance, NULL if the segment cannot be made
+struct rm_ctx *create_segment(int fd, const char *name, int p_count, int r_count, int r_exist[], int avoid, int shared) {
+    // The address is derived from the name, in a range other mappings rarely use
+    unsigned long hash = 5381;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    void *addr = (void *) (0x200000000000UL + (hash % 0x4000) * 0x40000000UL);
 
-int rm_release (int release[])
-{
-    /* critical section start */
-	pthread_mutex_lock(&mutex);
+    size_t stride = ((size_t) r_count + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+    size_t size = 2 * (sizeof(struct rm_ctx) + 8 * (size_t) p_count * stride * sizeof(int) +
+                       (size_t) p_count * (sizeof(struct thread_stats) + 1024) + (size_t) r_count * 256) + 65536;
 
-    // Find the user defined id of the calling thread
-    int user_defined_id = -1;
-    for (int i = 0; i < N; i++) {
-        if (threadList[i] == pthread_self()) {
-            user_defined_id = i;
+    for (int attempt = 0; attempt < 16; attempt++, size *= 2) {
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t) size) == -1) {
+            break;
+        }
+        struct rm_segment *seg = map_segment(fd, size, addr, 0);
+        if (seg == NULL) {
+            break;
         }
-    }
 
-    // Conditions that the function has an error
-    if (user_defined_id == -1) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+        seg->magic = SHARED_MAGIC;
+        seg->version = SEGMENT_VERSION;
+        seg->size = size;
+        seg->base = seg;
+        seg->used = sizeof(struct rm_segment);
+        seg->fd = -1;
 
-        return -1;
+        struct rm_ctx *ctx = segment_alloc(seg, sizeof(struct rm_ctx));
+        if (ctx != NULL) {
+            ctx->Segment = seg;
+            ctx->Shared = shared;
+            if (setup_instance(ctx, p_count, r_count, r_exist, avoid) == 0) {
+                seg->ctx = ctx;
+                seg->checksum = segment_checksum(seg);
+                atomic_store(&seg->ready, 1);
+                return ctx;
+            }
+        }
+
+        munmap(seg, size);
     }
 
-    // Return error if the released resources are more than the allocated ones
-    for (int i = 0; i < M; i++) {
-        if (release[i] > AllocationMat[user_defined_id][i]) {
-            /* critical section end */
-	        pthread_mutex_unlock(&mutex);
+    return NULL;
+}
 
-            return -1;
-        }
+// Maps the segment of the file fd at the address it was created at and checks its header
+// returns the segment, NULL if the file holds no segment of this version of the library (errno EINVAL), if
+// its instance is not set up yet (errno EAGAIN) or if the address is taken in this process (errno EADDRINUSE)
+struct rm_segment *attach_segment(int fd) {
+    struct rm_segment header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || header.magic != SHARED_MAGIC ||
+        header.version != SEGMENT_VERSION) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (atomic_load(&header.ready) == 0) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < header.size) {
+        errno = EINVAL; // Pages past the end of a truncated file cannot be accessed
+        return NULL;
     }
 
-    // Release the resources
-    for (int i = 0; i < M; i++) {
-        AllocationMat[user_defined_id][i] = AllocationMat[user_defined_id][i] - release[i];
-        AvailableRes[i] = AvailableRes[i] + release[i];
+    struct rm_segment *seg = map_segment(fd, header.size, header.base, 1);
+    if (seg == NULL) {
+        return NULL;
+    }
 
-        if (DA == 1) {
-            NeedMat[user_defined_id][i] = NeedMat[user_defined_id][i] + release[i];
-        }
+    struct rm_ctx *ctx = seg->ctx;
+    if (!segment_holds(seg, ctx, sizeof(struct rm_ctx)) || ctx->M < 1 ||
+        !segment_holds(seg, ctx->ExistingRes, (size_t) ctx->M * sizeof(int)) || segment_checksum(seg) != seg->checksum) {
+        munmap(seg, header.size);
+        errno = EINVAL;
+        return NULL;
     }
-    pthread_cond_broadcast(&cond);
 
-    /* critical section end */
-	pthread_mutex_unlock(&mutex);
+    return seg;
+}
 
-    return 0;
+// returns 1 if the size bytes at p are in the allocated part of the segment, 0 otherwise
+int segment_holds(struct rm_segment *seg, const void *p, size_t size) {
+    uintptr_t start = (uintptr_t) seg + sizeof(struct rm_segment);
+    uintptr_t end = (uintptr_t) seg + seg->used;
+
+    return seg->used <= seg->size && (uintptr_t) p >= start && (uintptr_t) p <= end && size <= end - (uintptr_t) p;
 }
 
+// returns the checksum (FNV-1a) of the header of the segment and of the configuration of its instance,
+// which never change once the instance is set up; the size of struct rm_ctx is included so that a library
+// with another layout of the instance refuses the segment
+unsigned long long segment_checksum(struct rm_segment *seg) {
+    struct rm_ctx *ctx = seg->ctx;
+    unsigned long long fields[] = {seg->magic, seg->version, seg->size, (uintptr_t) seg->base, seg->used,
+                                   (uintptr_t) ctx, sizeof(struct rm_ctx), ctx->N, ctx->M, ctx->RowStride,
+                                   ctx->DA, ctx->Shared};
 
-int rm_detection()
-{
-    /* Critical section starts here */
-    pthread_mutex_lock(&mutex);
+    unsigned long long sum = 14695981039346656037ULL;
+    sum = checksum_add(sum, fields, sizeof(fields));
+    sum = checksum_add(sum, ctx->ExistingRes, (size_t) ctx->M * sizeof(int));
 
-    int Work[MAXR];
-    int FinishTemp[MAXP];
-    int isAllSmallerOrEqual = 1;
-    int isDeadlocked = 0;
+    return sum;
+}
 
-    // Create a work vector and initialize it with available vector
-    for (int i = 0; i < M; i++) {
-        Work[i] = AvailableRes[i];
+unsigned long long checksum_add(unsigned long long sum, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t k = 0; k < size; k++) {
+        sum = (sum ^ bytes[k]) * 1099511628211ULL;
     }
 
-    // Populate the temporary finish function according to the requests of the threads
-    for (int i = 0; i < N; i++) {
-        FinishTemp[i] = 1;
-        // If the thread is already finished by rm_thread_ended function then mark it as finished
-        if (ThreadFinish[i] == 1) {
-            continue;
-        }
+    return sum;
+}
 
-        for (int j = 0; j < M; j++) {
-            if (RequestMat[i][j] != 0) {
-                FinishTemp[i] = 0;
-                break;
-            }
-        }
+// Adopts the instance that the process hosting a persistent instance before left in its file: the
+// allocations, max demands and started ids are kept, while the locks, the waiting requests and the
+// notifications belonged to that process and start over. Ids are continued by rm_thread_started again
+// returns the instance, NULL if its configuration is not the one given (errno EINVAL) or its state is
+// inconsistent (errno EBADMSG)
+struct rm_ctx *adopt_instance(struct rm_segment *seg, int p_count, int r_count, int r_exist[], int avoid) {
+    struct rm_ctx *ctx = seg->ctx;
+    if (ctx->Shared != 0 || ctx->N != p_count || ctx->M != r_count || ctx->DA != ((avoid != 0) ? 1 : 0) ||
+        memcmp(ctx->ExistingRes, r_exist, (size_t) r_count * sizeof(int)) != 0) {
+        errno = EINVAL;
+        return NULL;
     }
 
-    // The main detection
-    int i = 0;
-    while (1) {
-        if (FinishTemp[i] == 0) {
-            // Check if the request for each resource type is less than the available pool (Work)
-            isAllSmallerOrEqual = 1;
-            for (int j = 0; j < M; j++) {
-                if (RequestMat[i][j] > Work[j]) {
-                    isAllSmallerOrEqual = 0;
-                    break;
-                }
-            }
+    // The grant the process ended in is undone or completed before the allocations are checked
+    if (check_layout(ctx) == -1) {
+        errno = EBADMSG;
+        return NULL;
+    }
+    apply_journal(ctx);
+    if (check_state(ctx) == -1) {
+        errno = EBADMSG;
+        return NULL;
+    }
 
-            // if we find a thread that request less then or equal to the available resources
-            if (isAllSmallerOrEqual == 1) {
-                // update work vector
-                for (int k = 0; k < M; k++) {
-                    Work[k] = Work[k] + AllocationMat[i][k];
-                }
-                FinishTemp[i] = 1; // Mark the thread as finished
-                i = -1; // start from the beginning (there is i++ at the end of the while loop so make it -1)
-            }
-        }
+    if (pthread_key_create(&ctx->CallerKey, NULL) != 0) {
+        return NULL;
+    }
+    ctx->Serial = atomic_fetch_add(&NextSerial, 1); // Ids cached by threads for the instance are stale
 
-        // If we are at the last thread to check
-        if (i == (N - 1)) {
-            // Check if all threads are finished
-            isDeadlocked = 0;
-            for (int x = 0; x < N; x++) {
-                if (FinishTemp[x] == 0) {
-                    isDeadlocked = 1;
-                    break;
-                }
-            }
-            break;
-        }
+    init_locks(ctx);
+    for (int i = 0; i < ctx->N; i++) {
+        init_wait_cond(ctx, i);
+        memset(ctx->RequestMat[i], 0, ctx->RowStride * sizeof(int));
+        ctx->Waiting[i] = 0;
+        ctx->Detached[i] = 0;
+        ctx->Aborted[i] = 0;
+        ctx->DonePending[i] = 0;
+    }
+    for (int j = 0; j <= WAIT_UNSAFE(ctx); j++) {
+        ctx->WaitHead[j] = -1;
+        ctx->WaitTail[j] = -1;
+    }
+    ctx->OrderHead = -1;
+    ctx->OrderTail = -1;
+    ctx->DoneHead = 0;
+    ctx->DoneCount = 0;
+    atomic_store(&ctx->NumWaiters, 0);
+
+    ctx->DeadlockHandler = NULL;
+    ctx->DeadlockArg = NULL;
+    ctx->DeadlockFd = -1;
+    ctx->EventDetection = ctx->Recovery; // The recovery and the victim cost are kept, so blocking still runs it
+    ctx->AsyncFd = -1;
+    atomic_store(&ctx->Tracing, 0);
+    ctx->Trace = NULL;
+    ctx->DetectCopy = NULL;
+    ctx->Pool = NULL;
+
+    derive_state(ctx);
+
+    return ctx;
+}
+
+// returns 0 if the vectors and matrices of an adopted instance are where alloc_state put them, -1 otherwise
+int check_layout(struct rm_ctx *ctx) {
+    size_t stride = ((size_t) ctx->M + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+    size_t finishInts = ((size_t) ctx->N + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+    size_t n = (size_t) ctx->N;
 
-        i++;
+    if (ctx->N < 1 || (size_t) ctx->RowStride != stride || ctx->ExistingRes != ctx->StateBlock ||
+        ctx->AvailableRes != ctx->StateBlock + stride || ctx->ThreadFinish != ctx->StateBlock + 2 * stride ||
+        !segment_holds(ctx->Segment, ctx->StateBlock, (2 * stride + finishInts + 4 * n * stride) * sizeof(int)) ||
+        !segment_holds(ctx->Segment, ctx->RowTable, 4 * n * sizeof(int *)) ||
+        !segment_holds(ctx->Segment, ctx->GrantAlloc, stride * sizeof(int)) ||
+        ctx->AllocationMat != ctx->RowTable || ctx->RequestMat != ctx->RowTable + n ||
+        ctx->MaxDemandMat != ctx->RowTable + 2 * n || ctx->NeedMat != ctx->RowTable + 3 * n) {
+        return -1;
     }
-    // End of detection
 
-    // If there is no deadlock
-    if (isDeadlocked == 0) {
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+    int *matrices = ctx->ThreadFinish + finishInts;
+    for (size_t i = 0; i < 4 * n; i++) {
+        if (ctx->RowTable[i] != matrices + i * stride) {
+            return -1;
+        }
+    }
 
-        return 0;
+    int tid = atomic_load(&ctx->GrantTid);
+    return (tid >= -1 && tid < ctx->N) ? 0 : -1;
+}
+
+// returns 0 if the allocations and max demands of an adopted instance are consistent with its existing
+// resources, -1 otherwise; the rows must be zero padded for the vector kernels
+int check_state(struct rm_ctx *ctx) {
+    for (int j = 0; j < ctx->RowStride; j++) {
+        if (ctx->ExistingRes[j] < 0 || (j >= ctx->M && ctx->ExistingRes[j] != 0)) {
+            return -1;
+        }
     }
 
-    // If there is deadlock
-    else {
-        // Count the number of deadlocked processes
-        int countOfDeadlock = 0;
-        for (int i = 0; i < N; i++) {
-            if (FinishTemp[i] == 0) {
-                countOfDeadlock++;
+    // The allocations are subtracted from a copy of the existing resources
+    memcpy(ctx->AvailableRes, ctx->ExistingRes, ctx->RowStride * sizeof(int));
+    for (int i = 0; i < ctx->N; i++) {
+        if (ctx->ThreadFinish[i] != 0 && ctx->ThreadFinish[i] != 1) {
+            return -1;
+        }
+
+        for (int j = 0; j < ctx->RowStride; j++) {
+            int allocated = ctx->AllocationMat[i][j];
+            int demand = ctx->MaxDemandMat[i][j];
+            if (j >= ctx->M) {
+                if (allocated != 0 || demand != 0) {
+                    return -1;
+                }
+                continue;
             }
+            if (allocated < 0 || allocated > ctx->AvailableRes[j] ||
+                (ctx->DA == 1 && (allocated > demand || demand > ctx->ExistingRes[j]))) {
+                return -1;
+            }
+            ctx->AvailableRes[j] -= allocated;
         }
+    }
 
-        /* critical section end */
-	    pthread_mutex_unlock(&mutex);
+    return 0;
+}
 
-        return countOfDeadlock;
+// Maps the segment at addr, which must be used if fixed is 1 and is a hint otherwise
+// returns the mapping, NULL if it cannot be made (errno EADDRINUSE if addr is taken)
+struct rm_segment *map_segment(int fd, size_t size, void *addr, int fixed) {
+    void *p = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (p == MAP_FAILED && errno == EEXIST) {
+        errno = EADDRINUSE; // MAP_FIXED_NOREPLACE fails with EEXIST if the range overlaps a mapping
+    }
+    else if (p != MAP_FAILED && p != addr) {
+        munmap(p, size); // Kernels before MAP_FIXED_NOREPLACE take the address as a hint only
+        p = MAP_FAILED;
+        errno = EADDRINUSE;
+    }
+    if (p == MAP_FAILED && fixed == 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
-}
 
+    return (p == MAP_FAILED) ? NULL : p;
+}
 
-void rm_print_state (char hmsg[])
+// No thread may be using the instance
+void rm_destroy(struct rm_ctx *ctx)
 {
-    /* critical section start */
-	pthread_mutex_lock(&mutex);
+    if (ctx == NULL) {
+        return;
+    }
 
-    printf("#########################################\n");
-    printf("%s\n", hmsg);
-    printf("#########################################\n");
+    // A shared instance stays in its segment for the other processes
+    if (ctx->Shared == 1) {
+        struct rm_segment *seg = ctx->Segment;
+        munmap(seg->base, seg->size);
+        return;
+    }
 
-    printf("Exist:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    if (ctx->DeadlockFd != -1) {
+        close(ctx->DeadlockFd);
     }
-    printf("\n");
-    for(int i = 0; i < M; i++) {
-        if (i == 0) {
-            printf("%7d", ExistingRes[i]);
-        }
-        else {
-            printf("%5d", ExistingRes[i]);
-        }
+    if (ctx->AsyncFd != -1) {
+        close(ctx->AsyncFd);
     }
-    printf("\n\n");
-
-    printf("Available:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    if (ctx->Trace != NULL) {
+        fclose(ctx->Trace);
+    }
+    if (ctx->DetectCopy != NULL) {
+        free_state(ctx->DetectCopy);
+        free(ctx->DetectCopy);
+    }
+    if (ctx->Pool != NULL) {
+        pool_destroy(ctx->Pool);
+    }
+    pthread_mutex_destroy(&ctx->DetectLock);
+    pthread_mutex_destroy(&ctx->TraceLock);
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_key_delete(ctx->CallerKey);
+
+    // The state of a persistent instance stays in its file for the next process hosting it
+    if (ctx->Segment != NULL) {
+        struct rm_segment *seg = ctx->Segment;
+        int fd = seg->fd;
+        msync(seg->base, seg->size, MS_SYNC);
+        munmap(seg->base, seg->size);
+        close(fd); // Releases the lock of the file
+        return;
+    }
+
+    free_state(ctx);
+    free(ctx);
+}
+
+// Replaces the default instance used by the functions without a context
+int rm_init(int p_count, int r_count, int r_exist[],  int avoid)
+{
+    struct rm_ctx *ctx = rm_create(p_count, r_count, r_exist, avoid);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    rm_destroy(DefaultCtx);
+    DefaultCtx = ctx;
+
+    return 0;
+}
+
+int rm_init_shared(const char *name, int p_count, int r_count, int r_exist[], int avoid)
+{
+    struct rm_ctx *ctx = rm_create_shared(name, p_count, r_count, r_exist, avoid);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    rm_destroy(DefaultCtx);
+    DefaultCtx = ctx;
+
+    return 0;
+}
+
+int rm_attach_shared(const char *name)
+{
+    struct rm_ctx *ctx = rm_open_shared(name);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    rm_destroy(DefaultCtx);
+    DefaultCtx = ctx;
+
+    return 0;
+}
+
+int rm_init_file(const char *path, int p_count, int r_count, int r_exist[], int avoid)
+{
+    struct rm_ctx *ctx = rm_open_file(path, p_count, r_count, r_exist, avoid);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    rm_destroy(DefaultCtx);
+    DefaultCtx = ctx;
+
+    return 0;
+}
+
+// Selects the wait mode of the instances created from now on
+int rm_set_wait_mode(int mode)
+{
+    if (mode != RM_WAIT_BLOCK && mode != RM_WAIT_ADAPTIVE) {
+        return -1;
+    }
+
+    atomic_store(&NextWaitMode, mode);
+
+    return 0;
+}
+
+
+int rm_request_ctx(struct rm_ctx *ctx, int request[])
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error
+    if (user_defined_id == -1) {
+        return -1;
+    }
+
+    long long at = trace_now(ctx);
+    int ret = do_request(ctx, user_defined_id, request, REQUEST_BLOCK, NULL);
+    if (ret == 0) {
+        trace_event(ctx, RM_TRACE_REQUEST, user_defined_id, request, at);
+    }
+
+    return ret;
+}
+
+
+int rm_try_request_ctx(struct rm_ctx *ctx, int request[])
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error
+    if (user_defined_id == -1) {
+        return -1;
+    }
+
+    long long at = trace_now(ctx);
+    int ret = do_request(ctx, user_defined_id, request, REQUEST_TRY, NULL);
+    if (ret == 0) {
+        trace_event(ctx, RM_TRACE_REQUEST, user_defined_id, request, at);
+    }
+
+    return ret;
+}
+
+
+int rm_request_timed_ctx(struct rm_ctx *ctx, int request[], const struct timespec *deadline)
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error (the wait cannot take a deadline that is not normalized)
+    if (user_defined_id == -1 || deadline == NULL || deadline->tv_nsec < 0 || deadline->tv_nsec >= 1000000000L) {
+        return -1;
+    }
+
+    long long at = trace_now(ctx);
+    int ret = do_request(ctx, user_defined_id, request, REQUEST_TIMED, deadline);
+    if (ret == 0) {
+        trace_event(ctx, RM_TRACE_REQUEST, user_defined_id, request, at);
+    }
+
+    return ret;
+}
+
+
+int rm_release_ctx(struct rm_ctx *ctx, int release[])
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error
+    if (user_defined_id == -1) {
+        return -1;
+    }
+
+    return do_release(ctx, user_defined_id, release);
+}
+
+
+int rm_batch_ctx(struct rm_ctx *ctx, struct rm_op ops[], int count)
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error
+    if (user_defined_id == -1 || count < 0) {
+        return -1;
+    }
+
+    // Sum up the released and the requested resources of the operations
+    int *released = ctx->BatchScratch + (size_t) user_defined_id * 3 * ctx->RowStride;
+    int *requested = released + ctx->RowStride;
+    int *touched = requested + ctx->RowStride; // Resource types that are released or requested
+    memset(released, 0, 2 * ctx->RowStride * sizeof(int));
+
+    for (int k = 0; k < count; k++) {
+        if (ops[k].vec == NULL) {
+            return -1;
+        }
+
+        if (ops[k].type == RM_OP_RELEASE) {
+            Vec.add(released, ops[k].vec, ctx->M);
+        }
+        else if (ops[k].type == RM_OP_REQUEST) {
+            Vec.add(requested, ops[k].vec, ctx->M);
+        }
+        else {
+            return -1;
+        }
+    }
+
+    // Return error if the requested resources are more than the existing ones (they never change)
+    if (!Vec.le(requested, ctx->ExistingRes, ctx->M)) {
+        return -1;
+    }
+
+    // The batch is traced as a release of the released resources once it is accepted and a request of the
+    // requested ones once they are granted
+    long long at = trace_now(ctx);
+
+    // In detection mode release and request under the locks of the touched types only if the requested
+    // resources are available after the release (and the policy does not order the grants while there may
+    // be waiting requests)
+    if (ctx->DA == 0) {
+        for (int i = 0; i < ctx->M; i++) {
+            touched[i] = (released[i] != 0 || requested[i] != 0) ? 1 : 0;
+        }
+
+        lock_types(ctx, touched);
+
+        // Return error if the released resources are more than the allocated ones
+        if (!Vec.le(released, ctx->AllocationMat[user_defined_id], ctx->M)) {
+            unlock_types(ctx, touched);
+            return -1;
+        }
+
+        int granted = (atomic_load(&ctx->Ordered) == 0 || atomic_load(&ctx->NumWaiters) == 0);
+        for (int i = 0; granted && i < ctx->M; i++) {
+            granted = (requested[i] <= ctx->AvailableRes[i] + released[i]);
+        }
+        if (granted) {
+            Vec.sub(ctx->AllocationMat[user_defined_id], released, ctx->M);
+            Vec.add(ctx->AvailableRes, released, ctx->M);
+            Vec.sub(ctx->AvailableRes, requested, ctx->M);
+            Vec.add(ctx->AllocationMat[user_defined_id], requested, ctx->M);
+            count_grant(ctx, requested);
+
+            // Traced before other threads can take the released resources, so the trace keeps their order
+            trace_event(ctx, RM_TRACE_RELEASE, user_defined_id, released, at);
+            trace_event(ctx, RM_TRACE_REQUEST, user_defined_id, requested, at);
+        }
+
+        unlock_types(ctx, touched);
+
+        if (granted) {
+            // Offer what is left of the released resources to the waiting threads
+            if (atomic_load(&ctx->NumWaiters) > 0) {
+                /* critical section start */
+                lock_mutex(ctx);
+
+                wake_waiters(ctx, released);
+
+                /* critical section end */
+                unlock_mutex(ctx);
+            }
+
+            STAT_ADD(ctx, user_defined_id, requests, 1);
+            STAT_ADD(ctx, user_defined_id, grants, 1);
+
+            return 0;
+        }
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    // In detection mode the resource types are released under their own locks, and releasing threads
+    // take the mutex to grant waiting requests only if they see a waiting thread
+    int waitList = WAIT_UNSAFE(ctx);
+    if (ctx->DA == 0) {
+        atomic_fetch_add(&ctx->NumWaiters, 1);
+        lock_types(ctx, touched);
+
+        // Return error if the released resources are more than the allocated ones
+        if (!Vec.le(released, ctx->AllocationMat[user_defined_id], ctx->M)) {
+            unlock_types(ctx, touched);
+            atomic_fetch_sub(&ctx->NumWaiters, 1);
+
+            /* critical section end */
+            unlock_mutex(ctx);
+
+            return -1;
+        }
+
+        Vec.sub(ctx->AllocationMat[user_defined_id], released, ctx->M);
+        Vec.add(ctx->AvailableRes, released, ctx->M);
+        trace_event(ctx, RM_TRACE_RELEASE, user_defined_id, released, at);
+
+        // Threads taking resources without the mutex could take the released ones first, so the request
+        // is tried before the locks of the touched types are dropped
+        for (int i = 0; i < ctx->M; i++) {
+            ctx->RequestMat[user_defined_id][i] = requested[i]; // Fill the request matrix
+        }
+        STAT_ADD(ctx, user_defined_id, requests, 1);
+        order_key(ctx, user_defined_id);
+        if (!held_back(ctx, user_defined_id)) {
+            journal_begin(ctx, user_defined_id);
+            waitList = take_locked(ctx, user_defined_id, requested);
+            if (waitList == -1) {
+                journal_decided(ctx);
+                memset(ctx->RequestMat[user_defined_id], 0, ctx->RowStride * sizeof(int)); // Request is completed
+                count_bypass(ctx);
+            }
+            journal_end(ctx);
+        }
+
+        unlock_types(ctx, touched);
+    }
+    else {
+        // Return error if the released resources are more than the allocated ones or if the requested
+        // resources are more than the need after the release
+        if (!Vec.le(released, ctx->AllocationMat[user_defined_id], ctx->M)) {
+            /* critical section end */
+            unlock_mutex(ctx);
+
+            return -1;
+        }
+        for (int i = 0; i < ctx->M; i++) {
+            if (requested[i] > ctx->NeedMat[user_defined_id][i] + released[i]) {
+                /* critical section end */
+                unlock_mutex(ctx);
+
+                return -1;
+            }
+        }
+
+        // Release the resources
+        Vec.sub(ctx->AllocationMat[user_defined_id], released, ctx->M);
+        Vec.add(ctx->AvailableRes, released, ctx->M);
+        Vec.add(ctx->NeedMat[user_defined_id], released, ctx->M);
+        raise_need_bound(ctx, user_defined_id);
+        trace_event(ctx, RM_TRACE_RELEASE, user_defined_id, released, at);
+
+        // Go to the new state with one safety check for the combined result before any waiting thread
+        // can take the released resources
+        for (int i = 0; i < ctx->M; i++) {
+            ctx->RequestMat[user_defined_id][i] = requested[i]; // Fill the request matrix
+        }
+        STAT_ADD(ctx, user_defined_id, requests, 1);
+        order_key(ctx, user_defined_id);
+        if (!held_back(ctx, user_defined_id)) {
+            waitList = try_grant(ctx, user_defined_id);
+            if (waitList == -1) {
+                count_bypass(ctx);
+            }
+        }
+    }
+
+    // Offer what is left of the released resources to the waiting threads
+    wake_waiters(ctx, released);
+
+    int ret = 0;
+    if (waitList != -1) {
+        ret = wait_granted(ctx, user_defined_id, waitList, REQUEST_BLOCK, NULL);
+    }
+    if (ctx->DA == 0) {
+        atomic_fetch_sub(&ctx->NumWaiters, 1);
+    }
+    if (ret == 0) {
+        STAT_ADD(ctx, user_defined_id, grants, 1);
+    }
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    if (ret == 0) {
+        trace_event(ctx, RM_TRACE_REQUEST, user_defined_id, requested, at);
+    }
+
+    return ret;
+}
+
+
+int rm_detection_ctx(struct rm_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    return detect_copy(ctx, NULL);
+}
+
+
+int rm_detection_list_ctx(struct rm_ctx *ctx, int tids[])
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    return detect_copy(ctx, tids);
+}
+
+
+int rm_set_deadlock_handler_ctx(struct rm_ctx *ctx, rm_deadlock_handler handler, void *arg)
+{
+    // Deadlocks can only happen if they are not avoided; the handler would only exist in one process
+    if (ctx == NULL || ctx->DA == 1 || ctx->Shared == 1) {
+        return -1;
+    }
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    ctx->DeadlockHandler = handler;
+    ctx->DeadlockArg = arg;
+    ctx->EventDetection = (ctx->DeadlockHandler != NULL || ctx->DeadlockFd != -1 || ctx->Recovery == 1) ? 1 : 0;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_deadlock_fd_ctx(struct rm_ctx *ctx)
+{
+    // Deadlocks can only happen if they are not avoided; the fd would only exist in one process
+    if (ctx == NULL || ctx->DA == 1 || ctx->Shared == 1) {
+        return -1;
+    }
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    if (ctx->DeadlockFd == -1) {
+        ctx->DeadlockFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if (ctx->DeadlockFd != -1) {
+        ctx->EventDetection = 1;
+    }
+    int fd = ctx->DeadlockFd;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return fd;
+}
+
+
+int rm_set_recovery_ctx(struct rm_ctx *ctx, int enable, int victim_cost)
+{
+    // Deadlocks can only happen if they are not avoided
+    if (ctx == NULL || ctx->DA == 1 || victim_cost < RM_VICTIM_FEWEST_HELD || victim_cost > RM_VICTIM_YOUNGEST) {
+        return -1;
+    }
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    ctx->Recovery = (enable != 0) ? 1 : 0;
+    ctx->VictimCost = victim_cost;
+    ctx->EventDetection = (ctx->DeadlockHandler != NULL || ctx->DeadlockFd != -1 || ctx->Recovery == 1) ? 1 : 0;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_set_parallel_ctx(struct rm_ctx *ctx, int workers, long min_size)
+{
+    // The workers would only run in one process
+    if (ctx == NULL || min_size < 0 || ctx->Shared == 1) {
+        return -1;
+    }
+
+    // The workers are started before the locks are taken
+    struct rm_pool *pool = NULL;
+    if (workers > 1) {
+        pool = pool_create(workers);
+        if (pool == NULL) {
+            return -1;
+        }
+    }
+
+    // No reduction runs while both locks are held, so none is using the old pool
+    lock_robust(&ctx->DetectLock);
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    struct rm_pool *old = ctx->Pool;
+    ctx->Pool = pool;
+    ctx->ParallelMin = min_size;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+    pthread_mutex_unlock(&ctx->DetectLock);
+
+    if (old != NULL) {
+        pool_destroy(old);
+    }
+
+    return 0;
+}
+
+
+int rm_get_timing_ctx(struct rm_ctx *ctx, struct rm_timing *timing)
+{
+    if (ctx == NULL || timing == NULL) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    timing->safety_calls = ctx->SafetyCalls;
+    timing->safety_ns = ctx->SafetyNs;
+    timing->safety_cached = ctx->SafeCached;
+    timing->detection_calls = atomic_load_explicit(&ctx->DetectionCalls, memory_order_relaxed);
+    timing->detection_ns = atomic_load_explicit(&ctx->DetectionNs, memory_order_relaxed);
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_get_stats_ctx(struct rm_ctx *ctx, struct rm_thread_stats threads[], struct rm_type_stats types[])
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+    lock_all_types(ctx);
+
+    for (int i = 0; threads != NULL && i < ctx->N; i++) {
+        threads[i].requests = atomic_load_explicit(&ctx->Stats[i].requests, memory_order_relaxed);
+        threads[i].grants = atomic_load_explicit(&ctx->Stats[i].grants, memory_order_relaxed);
+        threads[i].blocks = atomic_load_explicit(&ctx->Stats[i].blocks, memory_order_relaxed);
+        threads[i].empty_wakeups = atomic_load_explicit(&ctx->Stats[i].emptyWakeups, memory_order_relaxed);
+        threads[i].safety_checks = atomic_load_explicit(&ctx->Stats[i].safetyChecks, memory_order_relaxed);
+        threads[i].rollbacks = atomic_load_explicit(&ctx->Stats[i].rollbacks, memory_order_relaxed);
+        threads[i].blocked_ns = atomic_load_explicit(&ctx->Stats[i].blockedNs, memory_order_relaxed);
+        threads[i].mutex_held_ns = atomic_load_explicit(&ctx->Stats[i].mutexHeldNs, memory_order_relaxed);
+        threads[i].type_lock_held_ns = atomic_load_explicit(&ctx->Stats[i].typeLockHeldNs, memory_order_relaxed);
+        threads[i].aborts = atomic_load_explicit(&ctx->Stats[i].aborts, memory_order_relaxed);
+    }
+
+    for (int j = 0; types != NULL && j < ctx->M; j++) {
+        types[j].grants = ctx->ResLock[j].grants;
+        types[j].units = ctx->ResLock[j].units;
+        types[j].blocks = ctx->ResLock[j].blocks;
+    }
+
+    /* critical section end */
+    unlock_all_types(ctx);
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_stats_timing_ctx(struct rm_ctx *ctx, int enable)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    atomic_store(&ctx->StatsTiming, (enable != 0) ? 1 : 0);
+
+    return 0;
+}
+
+
+int rm_set_policy_ctx(struct rm_ctx *ctx, int policy, int max_bypass)
+{
+    if (ctx == NULL || policy < RM_POLICY_ANY || policy > RM_POLICY_SMALLEST) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    ctx->Policy = policy;
+    ctx->MaxBypass = (max_bypass < 0) ? -1 : max_bypass;
+    atomic_store(&ctx->Ordered, (policy != RM_POLICY_ANY || ctx->MaxBypass >= 0) ? 1 : 0);
+
+    // Put the waiting threads in the new order and serve them by the new policy
+    int tid = ctx->OrderHead;
+    ctx->OrderHead = -1;
+    ctx->OrderTail = -1;
+    while (tid != -1) {
+        int next = ctx->OrderNext[tid];
+        int bypass = ctx->Bypass[tid];
+        order_insert(ctx, tid);
+        ctx->Bypass[tid] = bypass;
+        tid = next;
+    }
+    wake_waiters(ctx, NULL);
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_set_priority_ctx(struct rm_ctx *ctx, int priority)
+{
+    // Find the user defined id of the calling thread
+    int user_defined_id = caller_id(ctx);
+
+    // Conditions that the function has an error
+    if (user_defined_id == -1) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    ctx->Priority[user_defined_id] = priority;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+int rm_trace_start_ctx(struct rm_ctx *ctx, const char *path)
+{
+    // The trace file would only be open in one process
+    if (ctx == NULL || path == NULL || ctx->Shared == 1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->TraceLock);
+
+    // Only one trace is recorded at a time
+    if (ctx->Trace != NULL) {
+        pthread_mutex_unlock(&ctx->TraceLock);
+        return -1;
+    }
+
+    FILE *trace = fopen(path, "wb");
+    if (trace == NULL) {
+        pthread_mutex_unlock(&ctx->TraceLock);
+        return -1;
+    }
+
+    struct rm_trace_header header = {RM_TRACE_MAGIC, ctx->N, ctx->M, ctx->DA};
+    if (fwrite(&header, sizeof(header), 1, trace) != 1 ||
+        fwrite(ctx->ExistingRes, sizeof(int), ctx->M, trace) != (size_t) ctx->M) {
+        fclose(trace);
+        pthread_mutex_unlock(&ctx->TraceLock);
+        return -1;
+    }
+
+    ctx->Trace = trace;
+    ctx->TraceStart = clock_ns();
+    ctx->TraceSeq = 0;
+    atomic_store(&ctx->Tracing, 1);
+
+    pthread_mutex_unlock(&ctx->TraceLock);
+
+    return 0;
+}
+
+
+int rm_trace_stop_ctx(struct rm_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->TraceLock);
+
+    if (ctx->Trace == NULL) {
+        pthread_mutex_unlock(&ctx->TraceLock);
+        return -1;
+    }
+
+    atomic_store(&ctx->Tracing, 0);
+    int ret = (fclose(ctx->Trace) == 0) ? 0 : -1;
+    ctx->Trace = NULL;
+
+    pthread_mutex_unlock(&ctx->TraceLock);
+
+    return ret;
+}
+
+
+int rm_async_started_ctx(struct rm_ctx *ctx, int tid)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    return do_started(ctx, tid, 0);
+}
+
+
+int rm_async_ended_ctx(struct rm_ctx *ctx, int tid)
+{
+    // A thread with a waiting request cannot end
+    if (ctx == NULL || async_idle(ctx, tid) == 0) {
+        return -1;
+    }
+
+    do_ended(ctx, tid);
+
+    return 0;
+}
+
+
+int rm_async_claim_ctx(struct rm_ctx *ctx, int tid, int claim[])
+{
+    if (ctx == NULL || ctx->DA == 0 || async_idle(ctx, tid) == 0) {
+        return -1;
+    }
+
+    return do_claim(ctx, tid, claim);
+}
+
+
+int rm_request_async_ctx(struct rm_ctx *ctx, int tid, int request[], unsigned long long *ticket)
+{
+    // A thread makes one request at a time and the completion of the last one is polled first
+    if (ctx == NULL || ticket == NULL || async_idle(ctx, tid) == 0) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    // The ticket holds the id in the low bits so it finds the request again
+    *ticket = (++ctx->TicketSeq << 32) | (unsigned long long) tid;
+    ctx->Ticket[tid] = *ticket;
+
+    // A request granted later is traced by complete_detached with the time of this call
+    long long at = trace_now(ctx);
+    ctx->AsyncAt[tid] = at;
+    memcpy(ctx->AsyncReq + (size_t) tid * ctx->RowStride, request, ctx->M * sizeof(int));
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    int ret = do_request(ctx, tid, request, REQUEST_DETACHED, NULL);
+    if (ret == 0) {
+        trace_event(ctx, RM_TRACE_REQUEST, tid, request, at);
+    }
+
+    return ret;
+}
+
+
+int rm_async_release_ctx(struct rm_ctx *ctx, int tid, int release[])
+{
+    if (ctx == NULL || async_idle(ctx, tid) == 0) {
+        return -1;
+    }
+
+    return do_release(ctx, tid, release);
+}
+
+
+int rm_async_poll_ctx(struct rm_ctx *ctx, struct rm_completion done[], int max)
+{
+    if (ctx == NULL || max < 0) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    int count = (ctx->DoneCount < max) ? ctx->DoneCount : max;
+    for (int k = 0; k < count; k++) {
+        int tid = ctx->DoneIds[ctx->DoneHead];
+        done[k].ticket = ctx->Ticket[tid];
+        done[k].tid = tid;
+        done[k].result = ctx->DoneResult[ctx->DoneHead];
+        ctx->DonePending[tid] = 0;
+        ctx->DoneHead = (ctx->DoneHead + 1) % ctx->N;
+    }
+    ctx->DoneCount -= count;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return count;
+}
+
+
+int rm_async_fd_ctx(struct rm_ctx *ctx)
+{
+    // The fd would only exist in one process
+    if (ctx == NULL || ctx->Shared == 1) {
+        return -1;
+    }
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    // Completions queued before the fd existed are signaled right away
+    if (ctx->AsyncFd == -1) {
+        ctx->AsyncFd = eventfd((ctx->DoneCount > 0) ? 1 : 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    int fd = ctx->AsyncFd;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return fd;
+}
+
+
+int rm_async_cancel_ctx(struct rm_ctx *ctx, unsigned long long ticket)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    int tid = (int) (ticket & 0xffffffffULL);
+    if (tid < 0 || tid >= ctx->N) {
+        return -1;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    // Only a request that still waits can be cancelled, a completed one is in the queue
+    if (ctx->Ticket[tid] != ticket || ctx->Detached[tid] == 0 || ctx->Waiting[tid] == 0) {
+        /* critical section end */
+        unlock_mutex(ctx);
+
+        return -1;
+    }
+
+    // Give up the request; nothing was allocated for it and NeedMat only changes on grants
+    wait_unlink(ctx, tid);
+    order_remove(ctx, tid);
+    ctx->Waiting[tid] = 0;
+    ctx->Detached[tid] = 0;
+    memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int));
+    if (ctx->DA == 0) {
+        atomic_fetch_sub(&ctx->NumWaiters, 1);
+    }
+
+    // Requests held back for this one may be granted now
+    if (atomic_load(&ctx->Ordered) == 1) {
+        wake_waiters(ctx, NULL);
+    }
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+
+struct rm_snapshot *rm_snapshot_create_ctx(struct rm_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    size_t vecInts = 2 * (size_t) ctx->M + ctx->N;
+    size_t matInts = (size_t) ctx->N * ctx->M;
+    size_t seqInts = (size_t) ctx->M + 1; // Sequence counters rm_snapshot reads the state at (snapshot_seqs)
+
+    struct rm_snapshot *snap = malloc(sizeof(struct rm_snapshot));
+    if (snap == NULL) {
+        return NULL;
+    }
+    int *data = malloc((vecInts + 4 * matInts + seqInts) * sizeof(int));
+    if (data == NULL) {
+        free(snap);
+        return NULL;
+    }
+
+    snap->n = ctx->N;
+    snap->m = ctx->M;
+    snap->existing = data;
+    snap->available = data + ctx->M;
+    snap->finished = data + 2 * (size_t) ctx->M;
+    snap->allocation = data + vecInts;
+    snap->request = snap->allocation + matInts;
+    snap->max_demand = snap->request + matInts;
+    snap->need = snap->max_demand + matInts;
+
+    return snap;
+}
+
+
+void rm_snapshot_destroy(struct rm_snapshot *snap)
+{
+    if (snap != NULL) {
+        free(snap->existing);
+        free(snap);
+    }
+}
+
+
+int rm_snapshot_ctx(struct rm_ctx *ctx, struct rm_snapshot *snap)
+{
+    // Return error if the snapshot was made for other sizes
+    if (ctx == NULL || snap == NULL || snap->n != ctx->N || snap->m != ctx->M) {
+        return -1;
+    }
+
+    read_consistent(ctx, copy_state, snap, snapshot_seqs(snap));
+
+    return 0;
+}
+
+
+void rm_print_state_ctx(struct rm_ctx *ctx, char hmsg[])
+{
+    // Print from a snapshot so that no lock is held while printing
+    struct rm_snapshot *snap = rm_snapshot_create_ctx(ctx);
+    if (snap == NULL || rm_snapshot_ctx(ctx, snap) != 0) {
+        rm_snapshot_destroy(snap);
+        return;
+    }
+
+    printf("#########################################\n");
+    printf("%s\n", hmsg);
+    printf("#########################################\n");
+
+    print_vector("Exist", snap->existing, snap->m);
+    print_vector("Available", snap->available, snap->m);
+
+    print_matrix("Allocation", snap->allocation, snap->n, snap->m);
+    printf("\n");
+    print_matrix("Request", snap->request, snap->n, snap->m);
+    printf("\n");
+    print_matrix("MaxDemand", snap->max_demand, snap->n, snap->m);
+    printf("\n");
+    print_matrix("Need", snap->need, snap->n, snap->m);
+    printf("#########################################\n\n");
+
+    rm_snapshot_destroy(snap);
+}
+
+// Functions of the default instance
+// (rm_init, rm_init_shared and rm_attach_shared replace it)
+
+int rm_thread_started(int tid) { return rm_thread_started_ctx(DefaultCtx, tid); }
+int rm_thread_ended() { return rm_thread_ended_ctx(DefaultCtx); }
+int rm_claim(int claim[]) { return rm_claim_ctx(DefaultCtx, claim); }
+int rm_request(int request[]) { return rm_request_ctx(DefaultCtx, request); }
+int rm_try_request(int request[]) { return rm_try_request_ctx(DefaultCtx, request); }
+int rm_request_timed(int request[], const struct timespec *deadline) { return rm_request_timed_ctx(DefaultCtx, request, deadline); }
+int rm_release(int release[]) { return rm_release_ctx(DefaultCtx, release); }
+int rm_batch(struct rm_op ops[], int count) { return rm_batch_ctx(DefaultCtx, ops, count); }
+int rm_detection() { return rm_detection_ctx(DefaultCtx); }
+int rm_detection_list(int tids[]) { return rm_detection_list_ctx(DefaultCtx, tids); }
+int rm_set_deadlock_handler(rm_deadlock_handler handler, void *arg) { return rm_set_deadlock_handler_ctx(DefaultCtx, handler, arg); }
+int rm_deadlock_fd() { return rm_deadlock_fd_ctx(DefaultCtx); }
+int rm_set_recovery(int enable, int victim_cost) { return rm_set_recovery_ctx(DefaultCtx, enable, victim_cost); }
+int rm_set_parallel(int workers, long min_size) { return rm_set_parallel_ctx(DefaultCtx, workers, min_size); }
+int rm_get_timing(struct rm_timing *timing) { return rm_get_timing_ctx(DefaultCtx, timing); }
+int rm_get_stats(struct rm_thread_stats threads[], struct rm_type_stats types[]) { return rm_get_stats_ctx(DefaultCtx, threads, types); }
+int rm_stats_timing(int enable) { return rm_stats_timing_ctx(DefaultCtx, enable); }
+int rm_set_policy(int policy, int max_bypass) { return rm_set_policy_ctx(DefaultCtx, policy, max_bypass); }
+int rm_set_priority(int priority) { return rm_set_priority_ctx(DefaultCtx, priority); }
+int rm_async_started(int tid) { return rm_async_started_ctx(DefaultCtx, tid); }
+int rm_async_ended(int tid) { return rm_async_ended_ctx(DefaultCtx, tid); }
+int rm_async_claim(int tid, int claim[]) { return rm_async_claim_ctx(DefaultCtx, tid, claim); }
+int rm_request_async(int tid, int request[], unsigned long long *ticket) { return rm_request_async_ctx(DefaultCtx, tid, request, ticket); }
+int rm_async_release(int tid, int release[]) { return rm_async_release_ctx(DefaultCtx, tid, release); }
+int rm_async_poll(struct rm_completion done[], int max) { return rm_async_poll_ctx(DefaultCtx, done, max); }
+int rm_async_fd() { return rm_async_fd_ctx(DefaultCtx); }
+int rm_async_cancel(unsigned long long ticket) { return rm_async_cancel_ctx(DefaultCtx, ticket); }
+int rm_trace_start(const char *path) { return rm_trace_start_ctx(DefaultCtx, path); }
+int rm_trace_stop() { return rm_trace_stop_ctx(DefaultCtx); }
+struct rm_snapshot *rm_snapshot_create() { return rm_snapshot_create_ctx(DefaultCtx); }
+int rm_snapshot(struct rm_snapshot *snap) { return rm_snapshot_ctx(DefaultCtx, snap); }
+void rm_print_state(char hmsg[]) { rm_print_state_ctx(DefaultCtx, hmsg); }
+
+// Additional Functions
+
+// returns the user defined id bound to the calling thread by rm_thread_started, -1 if there is none
+// No lock is needed since the binding is thread local and only written by the thread itself
+int caller_id(struct rm_ctx *ctx) {
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    // The id of the last instance the thread used is cached to skip the thread specific lookup
+    if (callerSerial != ctx->Serial) {
+        callerId = (ctx->Shared == 0) ? (int) (intptr_t) pthread_getspecific(ctx->CallerKey) - 1 : find_bound(ctx);
+        callerSerial = ctx->Serial;
+    }
+
+    if (callerId < 0 || callerId >= ctx->N) {
+        return -1;
+    }
+
+    return callerId;
+}
+
+// returns the id of a shared instance bound to the calling thread, -1 if there is none
+// The entries of the ids bound to the calling thread only change by its own calls
+int find_bound(struct rm_ctx *ctx) {
+    pid_t self = getpid();
+    for (int i = 0; i < ctx->N; i++) {
+        if (ctx->Bound[i] == 1 && ctx->Owner[i] == self && pthread_equal(ctx->threadList[i], pthread_self())) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Marks the thread as started, bound to the calling thread if bound is 1 (rm_thread_started)
+// returns 0 on success, -1 if the id is out of range
+int do_started(struct rm_ctx *ctx, int tid, int bound) {
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    if ((tid < 0) || (tid >= ctx->N)) {
+        /* critical section end */
+	    unlock_mutex(ctx);
+
+        return -1;
+    }
+
+    trace_event(ctx, RM_TRACE_STARTED, tid, NULL, trace_now(ctx));
+
+    ctx->threadList[tid] = pthread_self(); // assign the real thread_id
+    ctx->Owner[tid] = getpid();
+    ctx->Bound[tid] = bound;
+    ctx->ThreadFinish[tid] = 0; // Thread is started fo mark it as not finished
+    ctx->Started[tid] = ++ctx->StartSeq;
+
+    // The need of the thread counts for the safety check again
+    if (ctx->DA == 1) {
+        raise_need_bound(ctx, tid);
+    }
+
+    /* critical section end */
+	unlock_mutex(ctx);
+
+    return 0;
+}
+
+// Marks the thread as ended
+void do_ended(struct rm_ctx *ctx, int user_defined_id) {
+    trace_event(ctx, RM_TRACE_ENDED, user_defined_id, NULL, trace_now(ctx));
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    ctx->ThreadFinish[user_defined_id] = 1; // Thread is ended so mark it as finished
+    ctx->Bound[user_defined_id] = 0;
+    ctx->NeedBoundStale = 1; // The need of the thread no longer counts
+
+    // A finished thread is no longer considered by the safety check, so waiting requests may be safe now
+    if (ctx->DA == 1) {
+        wake_waiters(ctx, NULL);
+    }
+
+    // Resources the thread still holds are never released, so waiting threads may be deadlocked now
+    if (ctx->DA == 0 && ctx->EventDetection == 1 && atomic_load(&ctx->NumWaiters) > 0) {
+        lock_all_types(ctx);
+        int countOfDeadlock = 0;
+        int recovered = 0;
+        if (Vec.nonzero(ctx->AllocationMat[user_defined_id], ctx->RowStride)) {
+            countOfDeadlock = detect_all(ctx, ctx->DeadlockIds);
+            recovered = recover(ctx, ctx->DeadlockIds, countOfDeadlock);
+        }
+        unlock_all_types(ctx);
+
+        if (recovered) {
+            wake_waiters(ctx, ctx->Freed);
+        }
+        if (countOfDeadlock > 0) {
+            report_deadlock(ctx, countOfDeadlock);
+        }
+    }
+
+    /* critical section end */
+	unlock_mutex(ctx);
+}
+
+// Sets the max demand of the thread; returns 0 on success, -1 if the demand is more than the existing resources
+int do_claim(struct rm_ctx *ctx, int user_defined_id, int claim[]) {
+    /* Critical section starts here */
+    lock_mutex(ctx);
+
+    // Succesfully populate the max demand info for the specified thread if the demand is not more than existing
+    for (int i = 0; i < ctx->M; i++) {
+        if (claim[i] > ctx->ExistingRes[i]) {
+            /* critical section end */
+	        unlock_mutex(ctx);
+
+            return -1;
+        }
+        ctx->MaxDemandMat[user_defined_id][i] = claim[i];
+        ctx->NeedMat[user_defined_id][i] = ctx->MaxDemandMat[user_defined_id][i] - ctx->AllocationMat[user_defined_id][i];
+    }
+    raise_need_bound(ctx, user_defined_id);
+
+    /* critical section end */
+	unlock_mutex(ctx);
+
+    trace_event(ctx, RM_TRACE_CLAIM, user_defined_id, claim, trace_now(ctx));
+    
+    return 0;
+}
+
+// Releases resources of the thread; returns 0 on success, -1 if it holds less
+int do_release(struct rm_ctx *ctx, int user_defined_id, int release[]) {
+    // Whether a release succeeds only depends on what the thread holds, so a replay gives the same result
+    trace_event(ctx, RM_TRACE_RELEASE, user_defined_id, release, trace_now(ctx));
+
+    // In detection mode release under the locks of the released types only
+    if (ctx->DA == 0) {
+        if (release_resources(ctx, user_defined_id, release) == -1) {
+            return -1;
+        }
+
+        // Take the mutex to grant waiting requests only if there is a waiting thread
+        if (atomic_load(&ctx->NumWaiters) > 0) {
+            /* critical section start */
+            lock_mutex(ctx);
+
+            wake_waiters(ctx, release);
+
+            /* critical section end */
+            unlock_mutex(ctx);
+        }
+
+        return 0;
+    }
+
+    /* critical section start */
+	lock_mutex(ctx);
+
+    // Return error if the released resources are more than the allocated ones
+    if (!Vec.le(release, ctx->AllocationMat[user_defined_id], ctx->M)) {
+        /* critical section end */
+	    unlock_mutex(ctx);
+
+        return -1;
+    }
+
+    // Release the resources
+    Vec.sub(ctx->AllocationMat[user_defined_id], release, ctx->M);
+    Vec.add(ctx->AvailableRes, release, ctx->M);
+    Vec.add(ctx->NeedMat[user_defined_id], release, ctx->M);
+    raise_need_bound(ctx, user_defined_id);
+    wake_waiters(ctx, release);
+
+    /* critical section end */
+	unlock_mutex(ctx);
+
+    return 0;
+}
+
+// Requests resources for the thread, waiting for them as given by how (REQUEST_BLOCK, REQUEST_TRY or
+// REQUEST_TIMED, in which case deadline is the absolute CLOCK_MONOTONIC time to give up at)
+// returns 0 on success, -1 on error, EWOULDBLOCK or ETIMEDOUT if the request could not be granted in time,
+// EDEADLK if the deadlock recovery aborted it, EINPROGRESS if a detached request waits;
+// on failure RequestMat and NeedMat are left as they were
+int do_request(struct rm_ctx *ctx, int tid, int request[], int how, const struct timespec *deadline) {
+    // Return error if the requested resources are more than the existing ones (they never change)
+    for (int i = 0; i < ctx->M; i++) {
+        if (request[i] > ctx->ExistingRes[i]) {
+            return -1;
+        }
+    }
+
+    STAT_ADD(ctx, tid, requests, 1);
+
+    // In detection mode try to allocate under the locks of the requested types only
+    // (unless the policy orders the grants and there may be waiting requests to be served first)
+    int ordered = atomic_load(&ctx->Ordered);
+    if (ctx->DA == 0 && (ordered == 0 || atomic_load(&ctx->NumWaiters) == 0)) {
+        if (take_resources(ctx, tid, request) == -1) {
+            STAT_ADD(ctx, tid, grants, 1);
+            return 0; // Return with success
+        }
+        if (how == REQUEST_TRY && ordered == 0) {
+            return EWOULDBLOCK;
+        }
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    // Check if the request is smaller than the need for the process
+    if (ctx->DA == 1 && !Vec.le(request, ctx->NeedMat[tid], ctx->M)) {
+        /* critical section end */
+        unlock_mutex(ctx);
+
+        return -1; // If the thread requests more resource than its max then there is an error
+    }
+
+    // Releasing threads take the mutex to grant waiting requests only if they see a waiting thread
+    if (ctx->DA == 0) {
+        atomic_fetch_add(&ctx->NumWaiters, 1);
+    }
+
+    for (int i = 0; i < ctx->M; i++) {
+        ctx->RequestMat[tid][i] = request[i]; // Fill the request matrix
+    }
+
+    // Go to the new state if it is possible now and the policy does not hold the request back for the
+    // waiting requests, otherwise wait until a releasing thread grants the request
+    int ret = 0;
+    int waitList = WAIT_UNSAFE(ctx);
+    order_key(ctx, tid);
+    if (!held_back(ctx, tid)) {
+        waitList = try_grant(ctx, tid);
+        if (waitList == -1) {
+            count_bypass(ctx);
+        }
+    }
+    if (waitList != -1 && how == REQUEST_TRY) {
+        memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int));
+        ret = EWOULDBLOCK;
+    }
+    else if (waitList != -1) {
+        ret = wait_granted(ctx, tid, waitList, how, deadline);
+    }
+
+    // A detached request stays among the waiters until complete_detached
+    if (ctx->DA == 0 && ret != EINPROGRESS) {
+        atomic_fetch_sub(&ctx->NumWaiters, 1);
+    }
+    if (ret == 0) {
+        STAT_ADD(ctx, tid, grants, 1);
+    }
+
+    /* critical section end */
+    unlock_mutex(ctx);
+    return ret;
+}
+
+// Waits until a releasing thread grants the request in RequestMat that try_grant could not grant
+// (waitList is the wait list try_grant returned); called with the mutex held
+// returns 0 once the request is granted, ETIMEDOUT if the deadline of a timed request passes first,
+// EDEADLK if the deadlock recovery aborted the request, EINPROGRESS right away for a detached request
+int wait_granted(struct rm_ctx *ctx, int tid, int waitList, int how, const struct timespec *deadline) {
+    long long start = clock_ns();
+    int ret = 0;
+
+    wait_enqueue(ctx, tid, waitList);
+    order_insert(ctx, tid);
+    STAT_ADD(ctx, tid, blocks, 1);
+    if (waitList != WAIT_UNSAFE(ctx)) {
+        ctx->ResLock[waitList].blocks++;
+    }
+    if (how == REQUEST_DETACHED) {
+        ctx->Detached[tid] = 1;
+    }
+
+    // Check if blocking the thread caused a deadlock
+    if (ctx->DA == 0 && ctx->EventDetection == 1) {
+        lock_all_types(ctx);
+        int countOfDeadlock = 0;
+        int recovered = 0;
+        if (detect_from(ctx, tid) > 0) {
+            countOfDeadlock = detect_all(ctx, ctx->DeadlockIds);
+            recovered = recover(ctx, ctx->DeadlockIds, countOfDeadlock);
+        }
+        unlock_all_types(ctx);
+
+        if (recovered) {
+            wake_waiters(ctx, ctx->Freed);
+        }
+        if (countOfDeadlock > 0) {
+            report_deadlock(ctx, countOfDeadlock);
+        }
+    }
+
+    // The result of a detached request is queued when its wait ends (it may have ended by the recovery)
+    if (how == REQUEST_DETACHED) {
+        return EINPROGRESS;
+    }
+
+    while (ctx->Waiting[tid] == 1) {
+        const struct timespec *until = (how == REQUEST_TIMED) ? deadline : NULL;
+
+        // Waits on a shared instance end every REAP_INTERVAL to end the ids of dead processes, since those
+        // may hold what the request waits for
+        struct timespec tick;
+        int ticking = 0;
+        if (ctx->Shared == 1) {
+            clock_gettime(CLOCK_MONOTONIC, &tick);
+            tick.tv_sec += REAP_INTERVAL;
+            if (until == NULL || tick.tv_sec < until->tv_sec || (tick.tv_sec == until->tv_sec && tick.tv_nsec < until->tv_nsec)) {
+                until = &tick;
+                ticking = 1;
+            }
+        }
+
+        int waited;
+        mutex_hold_end(ctx); // The wait does not hold the mutex
+        if (ctx->WaitMode == RM_WAIT_ADAPTIVE) {
+            waited = spin_wait(ctx, tid, until);
+        }
+        else if (until == NULL) {
+            waited = pthread_cond_wait(&ctx->WaitCond[tid], &ctx->mutex);
+        }
+        else {
+            waited = pthread_cond_timedwait(&ctx->WaitCond[tid], &ctx->mutex, until);
+        }
+        if (waited == EOWNERDEAD) {
+            pthread_mutex_consistent(&ctx->mutex);
+        }
+        mutex_acquired(ctx, waited == EOWNERDEAD);
+
+        int timedOut = (waited == ETIMEDOUT && ticking == 0);
+        if (waited == ETIMEDOUT && ticking == 1) {
+            reap_dead(ctx);
+        }
+
+        // A wait that failed would fail again, so the request is given up instead of waiting in a loop
+        int failed = (waited != 0 && waited != ETIMEDOUT && waited != EOWNERDEAD);
+
+        if ((timedOut || failed) && ctx->Waiting[tid] == 1) {
+            // Give up the request; nothing was allocated for it while it waited
+            wait_unlink(ctx, tid);
+            order_remove(ctx, tid);
+            ctx->Waiting[tid] = 0;
+            memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int));
+            ret = timedOut ? ETIMEDOUT : -1;
+
+            // Requests held back for this one may be granted now
+            if (atomic_load(&ctx->Ordered) == 1) {
+                wake_waiters(ctx, NULL);
+            }
+        }
+        else if (ctx->Waiting[tid] == 1) {
+            STAT_ADD(ctx, tid, emptyWakeups, 1); // Woken up while the request is still not granted
+        }
+    }
+
+    // The request was aborted to recover from a deadlock
+    if (ctx->Aborted[tid] == 1) {
+        ctx->Aborted[tid] = 0;
+        ret = EDEADLK;
+    }
+
+    STAT_ADD(ctx, tid, blockedNs, clock_ns() - start);
+
+    return ret;
+}
+
+// Runs the detection on the whole state and stores the ids of the deadlocked threads in tids
+// A thread that has no pending request runs to completion and returns what it holds; a thread that
+// ended while still holding resources never returns them. The mutex and all type locks must be held
+// returns the num of deadlocked threads
+int detect_all(struct rm_ctx *ctx, int tids[]) {
+    long long start = clock_ns();
+
+    for (int i = 0; i < ctx->N; i++) {
+        ctx->FinishTemp[i] = ctx->ThreadFinish[i];
+    }
+
+    int countOfDeadlock = 0;
+    if (reduce(ctx, ctx->RequestMat, ctx->FinishTemp, NULL) > 0) {
+        for (int i = 0; i < ctx->N; i++) {
+            if (ctx->FinishTemp[i] == 0) {
+                tids[countOfDeadlock++] = i;
+            }
+        }
+    }
+
+    atomic_fetch_add_explicit(&ctx->DetectionCalls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->DetectionNs, clock_ns() - start, memory_order_relaxed);
+
+    return countOfDeadlock;
+}
+
+// Runs the detection only on the threads the progress of the blocked thread depends on
+// A resource type a thread is short on can only become available through its holders, and the types
+// that are not short for any of these threads never block them, so these threads are deadlocked
+// exactly when they are deadlocked in the whole state. The mutex and all type locks must be held
+// returns the num of deadlocked threads among them
+int detect_from(struct rm_ctx *ctx, int tid) {
+    long long start = clock_ns();
+    int queueSize = 0;
+
+    for (int i = 0; i < ctx->N; i++) {
+        ctx->FinishTemp[i] = 1; // Threads outside the checked part are left out
+        ctx->Visited[i] = 0;
+    }
+    for (int j = 0; j < ctx->M; j++) {
+        ctx->TypeSeen[j] = 0;
+    }
+
+    ctx->WorkList[queueSize++] = tid;
+    ctx->Visited[tid] = 1;
+
+    for (int q = 0; q < queueSize; q++) {
+        int u = ctx->WorkList[q];
+        ctx->FinishTemp[u] = ctx->ThreadFinish[u];
+
+        // Running and ended threads do not wait for anyone
+        if (ctx->ThreadFinish[u] == 1 || ctx->Waiting[u] == 0) {
+            continue;
+        }
+
+        // Add the holders of the resource types the thread is short on
+        int count = Vec.gt_index(ctx->RequestMat[u], ctx->AvailableRes, ctx->RowStride, ctx->BlockIdx);
+        for (int b = 0; b < count; b++) {
+            int j = ctx->BlockIdx[b];
+            if (ctx->TypeSeen[j] == 1) {
+                continue;
+            }
+            ctx->TypeSeen[j] = 1;
+
+            for (int v = 0; v < ctx->N; v++) {
+                if (ctx->Visited[v] == 0 && ctx->AllocationMat[v][j] > 0) {
+                    ctx->Visited[v] = 1;
+                    ctx->WorkList[queueSize++] = v;
+                }
+            }
+        }
+    }
+
+    int countOfDeadlock = reduce(ctx, ctx->RequestMat, ctx->FinishTemp, NULL);
+
+    atomic_fetch_add_explicit(&ctx->DetectionCalls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->DetectionNs, clock_ns() - start, memory_order_relaxed);
+
+    return countOfDeadlock;
+}
+
+// Runs the detection on a copy of the state made without the locks, so requests and releases go on while
+// it scans. A deadlock found in the copy still exists unless the state changed since the copy, since
+// deadlocked threads stay deadlocked until their requests end; only then is the detection run again under
+// the locks. A found deadlock is recovered if the recovery is enabled
+// returns the num of deadlocked threads and stores their ids in tids (in scratch space if tids is NULL),
+// -1 if there is no memory for the copy
+int detect_copy(struct rm_ctx *ctx, int tids[]) {
+    lock_robust(&ctx->DetectLock); // The copy is rewritten before it is used, so a dead owner leaves nothing to repair
+    unsigned int *seqs = ctx->DetectSeqs;
+
+    if (ctx->DetectCopy == NULL) {
+        ctx->DetectCopy = create_detect_copy(ctx);
+        if (ctx->DetectCopy == NULL) {
+            pthread_mutex_unlock(&ctx->DetectLock);
+            return -1;
+        }
+    }
+    if (tids == NULL) {
+        tids = ctx->DetectCopy->DeadlockIds;
+    }
+
+    struct rm_ctx *copy = ctx->DetectCopy;
+    copy->Pool = ctx->Pool; // The copy is reduced by the workers of the instance
+    copy->ParallelMin = ctx->ParallelMin;
+    int consistent = read_consistent(ctx, copy_detection_state, copy, seqs);
+
+    atomic_store_explicit(&copy->DetectionCalls, 0, memory_order_relaxed);
+    atomic_store_explicit(&copy->DetectionNs, 0, memory_order_relaxed);
+    int countOfDeadlock = detect_all(copy, tids);
+    atomic_fetch_add_explicit(&ctx->DetectionCalls, atomic_load_explicit(&copy->DetectionCalls, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->DetectionNs, atomic_load_explicit(&copy->DetectionNs, memory_order_relaxed),
+                              memory_order_relaxed);
+
+    if (countOfDeadlock == 0) {
+        pthread_mutex_unlock(&ctx->DetectLock);
+        return 0;
+    }
+
+    /* Critical section starts here */
+    lock_mutex(ctx);
+    lock_all_types(ctx);
+
+    // Taking the mutex made StateSeq odd; any other change of the state moved the counters further
+    int changed = !consistent || atomic_load_explicit(&ctx->StateSeq, memory_order_relaxed) != seqs[0] + 1;
+    for (int j = 0; j < ctx->M && !changed; j++) {
+        changed = atomic_load_explicit(&ctx->ResLock[j].seq, memory_order_relaxed) != seqs[j + 1];
+    }
+    if (changed) {
+        countOfDeadlock = detect_all(ctx, tids);
+    }
+
+    int recovered = recover(ctx, tids, countOfDeadlock);
+    unlock_all_types(ctx);
+
+    if (recovered) {
+        wake_waiters(ctx, ctx->Freed);
+    }
+
+    /* critical section end */
+    unlock_mutex(ctx);
+    pthread_mutex_unlock(&ctx->DetectLock);
+
+    return countOfDeadlock;
+}
+
+// returns a second instance with the sizes of the instance for detect_copy, NULL if there is no memory
+struct rm_ctx *create_detect_copy(struct rm_ctx *ctx) {
+    // The copy of a shared instance is in its segment with the instance, otherwise it is private
+    struct rm_ctx *copy = (ctx->Shared == 1) ? state_calloc(ctx, 1, sizeof(struct rm_ctx)) : calloc(1, sizeof(struct rm_ctx));
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    copy->Segment = (ctx->Shared == 1) ? ctx->Segment : NULL;
+    copy->Shared = ctx->Shared;
+    if (alloc_state(copy, ctx->N, ctx->M) == -1) {
+        state_free(copy, copy);
+        return NULL;
+    }
+    copy->N = ctx->N;
+    copy->M = ctx->M;
+    for (int i = 0; i < copy->N; i++) {
+        pthread_cond_init(&copy->WaitCond[i], NULL); // Unused, initialized for free_state
+    }
+    for (int j = 0; j < copy->M; j++) {
+        pthread_mutex_init(&copy->ResLock[j].lock, NULL);
+    }
+
+    return copy;
+}
+
+// Notifies the deadlock in DeadlockIds through the eventfd and the handler
+// Called with the mutex held; the mutex is released while the handler runs
+void report_deadlock(struct rm_ctx *ctx, int count) {
+    if (ctx->DeadlockFd != -1) {
+        uint64_t one = 1;
+        ssize_t written = write(ctx->DeadlockFd, &one, sizeof(one)); // Only fails if the counter is full
+        (void) written;
+    }
+
+    if (ctx->DeadlockHandler == NULL) {
+        return;
+    }
+
+    // The handler gets its own copy since other threads may detect again once the mutex is released
+    int *tids = malloc((size_t) count * sizeof(int));
+    if (tids == NULL) {
+        return;
+    }
+    memcpy(tids, ctx->DeadlockIds, (size_t) count * sizeof(int));
+    rm_deadlock_handler handler = ctx->DeadlockHandler;
+    void *arg = ctx->DeadlockArg;
+
+    unlock_mutex(ctx);
+    handler(count, tids, arg);
+    lock_mutex(ctx);
+
+    free(tids);
+}
+
+// Recovers from the deadlock of the count threads in tids if recovery is enabled: aborts the pending
+// request of victims picked by the victim cost and returns their allocation to the available pool until
+// no thread is deadlocked. The mutex and all type locks must be held; the caller wakes the waiting
+// threads with the resources in Freed once the type locks are released
+// returns 1 if some victim was aborted, 0 otherwise
+int recover(struct rm_ctx *ctx, int tids[], int count) {
+    if (ctx->Recovery == 0 || count <= 0) {
+        return 0;
+    }
+
+    memset(ctx->Freed, 0, ctx->RowStride * sizeof(int));
+
+    int *deadlocked = tids;
+    while (count > 0) {
+        int victim = deadlocked[0];
+        for (int k = 1; k < count; k++) {
+            if (victim_before(ctx, deadlocked[k], victim)) {
+                victim = deadlocked[k];
+            }
+        }
+
+        // Take back what the victim holds and fail its request (traced as a release of what it held, since
+        // the failed request is left out of the trace)
+        trace_event(ctx, RM_TRACE_RELEASE, victim, ctx->AllocationMat[victim], trace_now(ctx));
+        Vec.add(ctx->Freed, ctx->AllocationMat[victim], ctx->RowStride);
+        Vec.add(ctx->AvailableRes, ctx->AllocationMat[victim], ctx->RowStride);
+        memset(ctx->AllocationMat[victim], 0, ctx->RowStride * sizeof(int));
+        memset(ctx->RequestMat[victim], 0, ctx->RowStride * sizeof(int));
+
+        wait_unlink(ctx, victim);
+        order_remove(ctx, victim);
+        ctx->Waiting[victim] = 0;
+        STAT_ADD(ctx, victim, aborts, 1);
+        if (ctx->Detached[victim] == 1) {
+            complete_detached(ctx, victim, EDEADLK);
+        }
+        else {
+            ctx->Aborted[victim] = 1;
+            wake_thread(ctx, victim);
+        }
+
+        deadlocked = ctx->RecoverIds;
+        count = detect_all(ctx, deadlocked);
+    }
+
+    return 1;
+}
+
+// returns 1 if thread a is a better victim than thread b by the victim cost, 0 otherwise
+int victim_before(struct rm_ctx *ctx, int a, int b) {
+    long long heldA = 0;
+    long long heldB = 0;
+    for (int i = 0; i < ctx->M; i++) {
+        heldA += ctx->AllocationMat[a][i];
+        heldB += ctx->AllocationMat[b][i];
+    }
+
+    if (ctx->VictimCost == RM_VICTIM_LOWEST_PRIORITY && ctx->Priority[a] != ctx->Priority[b]) {
+        return ctx->Priority[a] < ctx->Priority[b];
+    }
+    if (ctx->VictimCost != RM_VICTIM_YOUNGEST && heldA != heldB) {
+        return heldA < heldB;
+    }
+
+    return ctx->Started[a] > ctx->Started[b];
+}
+
+// returns 1 if the system is currently safe, 0 if not safe, -1 if there is an error
+int safety_check(struct rm_ctx *ctx) {
+    long long start = clock_ns();
+
+    // Recompute the bound of the needs if a need decreased since it was computed
+    if (ctx->NeedBoundStale == 1) {
+        memset(ctx->NeedBound, 0, ctx->RowStride * sizeof(int));
+    }
+
+    int unfinished = 0;
+    for (int i = 0; i < ctx->N; i++) {
+        if (ctx->ThreadFinish[i] == 1) {
+            ctx->FinishTemp[i] = 1;
+        }
+
+        else {
+            ctx->FinishTemp[i] = 0;
+            unfinished++;
+
+            if (ctx->NeedBoundStale == 1) {
+                raise_need_bound(ctx, i);
+            }
+        }
+    }
+    ctx->NeedBoundStale = 0;
+
+    // The order of the last full check is usually still a safe sequence
+    if (check_safe_seq(ctx, unfinished) == 1) {
+        ctx->SafeCached++;
+        ctx->SafetyCalls++;
+        ctx->SafetyNs += clock_ns() - start;
+        return 1;
+    }
+
+    // The main safety_check, which keeps the order it finds for the next checks
+    ctx->SafeLen = unfinished;
+    unfinished = reduce(ctx, ctx->NeedMat, ctx->FinishTemp, ctx->SafeSeq);
+    if (unfinished != 0) {
+        ctx->SafeLen = 0;
+    }
+
+    ctx->SafetyCalls++;
+    ctx->SafetyNs += clock_ns() - start;
+
+    if (unfinished < 0) {
+        return -1;
+    }
+    if (unfinished > 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// Replays the cached safe sequence against the current state: each thread of the order must be able to
+// finish with the resources left by the threads before it; finished threads are skipped
+// returns 1 if the order is a safe sequence covering all unfinished threads, 0 if the full check is needed
+int check_safe_seq(struct rm_ctx *ctx, int unfinished) {
+    if (ctx->SafeLen < unfinished) {
+        return 0;
+    }
+
+    memcpy(ctx->Work, ctx->AvailableRes, ctx->RowStride * sizeof(int));
+
+    int covered = 0;
+    for (int k = 0; k < ctx->SafeLen; k++) {
+        int i = ctx->SafeSeq[k];
+        if (ctx->ThreadFinish[i] == 1) {
+            continue;
+        }
+
+        if (!Vec.le(ctx->NeedMat[i], ctx->Work, ctx->RowStride)) {
+            return 0;
+        }
+        Vec.add(ctx->Work, ctx->AllocationMat[i], ctx->RowStride);
+        covered++;
+    }
+
+    // Threads started since the order was found are not in it
+    return covered == unfinished;
+}
+
+// returns the time of the monotonic clock in nanoseconds
+long long clock_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// returns the time of a call to be traced, 0 if no trace is being recorded
+long long trace_now(struct rm_ctx *ctx) {
+    if (atomic_load_explicit(&ctx->Tracing, memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    return clock_ns();
+}
+
+// Appends an event of the thread to the trace if one is being recorded; at is the time of the call
+// (trace_now) and vec holds M entries or is NULL for an event without a vector
+void trace_event(struct rm_ctx *ctx, int type, int tid, const int vec[], long long at) {
+    if (atomic_load_explicit(&ctx->Tracing, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->TraceLock);
+
+    // The recording may have started after the call or stopped since
+    if (ctx->Trace != NULL) {
+        struct rm_trace_event event = {type, tid, (at > ctx->TraceStart) ? at - ctx->TraceStart : 0, ctx->TraceSeq++};
+        fwrite(&event, sizeof(event), 1, ctx->Trace);
+        if (vec != NULL) {
+            fwrite(vec, sizeof(int), ctx->M, ctx->Trace);
+        }
+        else {
+            static const int zero = 0;
+            for (int i = 0; i < ctx->M; i++) {
+                fwrite(&zero, sizeof(int), 1, ctx->Trace);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->TraceLock);
+}
+
+// Tries to go to the new state for the request of the thread in RequestMat
+// returns -1 if the request is granted (RequestMat row is cleared), otherwise the wait list the thread belongs to
+int try_grant(struct rm_ctx *ctx, int tid) {
+    // In detection mode the resource types are allocated under their own locks
+    if (ctx->DA == 0) {
+        journal_begin(ctx, tid);
+        int shortType = take_resources(ctx, tid, ctx->RequestMat[tid]);
+        if (shortType != -1) {
+            journal_end(ctx);
+            return shortType;
+        }
+
+        journal_decided(ctx);
+        memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int)); // Request is completed
+        journal_end(ctx);
+
+        return -1;
+    }
+
+    // Check if there is enough available resources
+    if (!Vec.le(ctx->RequestMat[tid], ctx->AvailableRes, ctx->RowStride)) {
+        for (int i = 0; i < ctx->M; i++) {
+            if (ctx->RequestMat[tid][i] > ctx->AvailableRes[i]) {
+                return i;
+            }
+        }
+    }
+
+    // The safety check is needed only if the resources left after the grant may not cover every need
+    int checkNeeded = !fits_need_bound(ctx, tid);
+
+    // Pretend to go into the new state
+    journal_begin(ctx, tid);
+    Vec.sub(ctx->AvailableRes, ctx->RequestMat[tid], ctx->RowStride);
+    Vec.add(ctx->AllocationMat[tid], ctx->RequestMat[tid], ctx->RowStride);
+    Vec.sub(ctx->NeedMat[tid], ctx->RequestMat[tid], ctx->RowStride);
+
+    if (checkNeeded) {
+        STAT_ADD(ctx, tid, safetyChecks, 1);
+    }
+
+    // Running the safety check algorithm on new state
+    if (checkNeeded && safety_check(ctx) != 1) {
+        STAT_ADD(ctx, tid, rollbacks, 1);
+
+        // Roll back to old state
+        Vec.add(ctx->AvailableRes, ctx->RequestMat[tid], ctx->RowStride);
+        Vec.sub(ctx->AllocationMat[tid], ctx->RequestMat[tid], ctx->RowStride);
+        Vec.add(ctx->NeedMat[tid], ctx->RequestMat[tid], ctx->RowStride);
+        raise_need_bound(ctx, tid);
+        journal_end(ctx);
+
+        return WAIT_UNSAFE(ctx);
+    }
+
+    // The need of the thread decreased (the safety check already recomputed the bound for the new state)
+    if (checkNeeded == 0) {
+        ctx->NeedBoundStale = 1;
+    }
+
+    // If we are here then it is safe to go to next state
+    journal_decided(ctx);
+    count_grant(ctx, ctx->RequestMat[tid]);
+    memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int)); // Request is completed
+    journal_end(ctx);
+
+    return -1;
+}
+
+// Allocates the requested resources to the thread if all of them are available (detection mode only)
+// Only the locks of the requested types are held, so disjoint requests proceed in parallel
+// returns -1 if the resources are allocated, otherwise a requested resource type that is not available
+int take_resources(struct rm_ctx *ctx, int tid, int request[]) {
+    lock_types(ctx, request);
+    int shortType = take_locked(ctx, tid, request);
+    unlock_types(ctx, request);
+
+    return shortType;
+}
+
+// Allocates the requested resources to the thread as take_resources does, with the locks of the requested
+// types already held by the caller
+int take_locked(struct rm_ctx *ctx, int tid, int request[]) {
+    int shortType = -1;
+
+    // Check if there is enough available resources
+    if (!Vec.le(request, ctx->AvailableRes, ctx->M)) {
+        for (int i = 0; i < ctx->M; i++) {
+            if (request[i] > ctx->AvailableRes[i]) {
+                shortType = i;
+                break;
+            }
+        }
+    }
+
+    // Go to new state
+    if (shortType == -1) {
+        Vec.sub(ctx->AvailableRes, request, ctx->M);
+        Vec.add(ctx->AllocationMat[tid], request, ctx->M);
+        count_grant(ctx, request);
+    }
+
+    return shortType;
+}
+
+// Returns the released resources of the thread to the available pool (detection mode only)
+// returns 0 on success, -1 if the released resources are more than the allocated ones
+int release_resources(struct rm_ctx *ctx, int tid, int release[]) {
+    lock_types(ctx, release);
+
+    // Return error if the released resources are more than the allocated ones
+    if (!Vec.le(release, ctx->AllocationMat[tid], ctx->M)) {
+        unlock_types(ctx, release);
+        return -1;
+    }
+
+    // Release the resources
+    Vec.sub(ctx->AllocationMat[tid], release, ctx->M);
+    Vec.add(ctx->AvailableRes, release, ctx->M);
+
+    unlock_types(ctx, release);
+
+    return 0;
+}
+
+// Takes the locks of the resource types with a nonzero entry in vec in increasing order
+void lock_types(struct rm_ctx *ctx, int vec[]) {
+    for (int i = 0; i < ctx->M; i++) {
+        if (vec[i] != 0) {
+            lock_type(ctx, i);
+            atomic_store_explicit(&ctx->ResLock[i].seq, atomic_load_explicit(&ctx->ResLock[i].seq, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+
+    if (atomic_load_explicit(&ctx->StatsTiming, memory_order_relaxed)) {
+        typesLockedAt = clock_ns();
+    }
+}
+
+void unlock_types(struct rm_ctx *ctx, int vec[]) {
+    if (typesLockedAt != 0) {
+        int tid = caller_id(ctx);
+        if (tid != -1) {
+            STAT_ADD(ctx, tid, typeLockHeldNs, clock_ns() - typesLockedAt);
+        }
+        typesLockedAt = 0;
+    }
+
+    for (int i = ctx->M - 1; i >= 0; i--) {
+        if (vec[i] != 0) {
+            atomic_store_explicit(&ctx->ResLock[i].seq, atomic_load_explicit(&ctx->ResLock[i].seq, memory_order_relaxed) + 1,
+                                  memory_order_release);
+            unlock_type(ctx, i);
+        }
+    }
+}
+
+// Takes the mutex; when lock timing is enabled the time the calling thread holds it is counted
+void lock_mutex(struct rm_ctx *ctx) {
+    if (ctx->WaitMode == RM_WAIT_ADAPTIVE) {
+        spin_lock(ctx, &ctx->SpinMutex);
+        mutex_acquired(ctx, 0);
+        return;
+    }
+
+    mutex_acquired(ctx, lock_robust(&ctx->mutex));
+}
+
+// Starts holding the mutex just taken; if its owner died (only with the robust mutex of a shared instance),
+// the state it may have left half updated is repaired first
+void mutex_acquired(struct rm_ctx *ctx, int ownerDied) {
+    // The dead owner left StateSeq odd
+    if (ownerDied && (atomic_load_explicit(&ctx->StateSeq, memory_order_relaxed) & 1)) {
+        atomic_fetch_add_explicit(&ctx->StateSeq, 1, memory_order_relaxed);
+    }
+
+    mutex_hold_begin(ctx);
+
+    if (ownerDied) {
+        repair_state(ctx);
+    }
+}
+
+// Takes the mutex m; returns 1 if its owner died (the mutex is made consistent), 0 otherwise
+int lock_robust(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Takes the lock of resource type j; if its owner died, the Available entry of the type it may have left
+// half updated is derived from the allocations again
+void lock_type(struct rm_ctx *ctx, int j) {
+    if (ctx->WaitMode == RM_WAIT_ADAPTIVE) {
+        spin_lock(ctx, &ctx->ResLock[j].spin);
+        return;
+    }
+    if (lock_robust(&ctx->ResLock[j].lock) == 0) {
+        return;
+    }
+
+    if (atomic_load_explicit(&ctx->ResLock[j].seq, memory_order_relaxed) & 1) {
+        atomic_fetch_add_explicit(&ctx->ResLock[j].seq, 1, memory_order_relaxed);
+    }
+
+    int allocated = 0;
+    for (int i = 0; i < ctx->N; i++) {
+        allocated += ctx->AllocationMat[i][j];
+    }
+    ctx->AvailableRes[j] = ctx->ExistingRes[j] - allocated;
+}
+
+void unlock_type(struct rm_ctx *ctx, int j) {
+    if (ctx->WaitMode == RM_WAIT_ADAPTIVE) {
+        spin_unlock(&ctx->ResLock[j].spin);
+    }
+    else {
+        pthread_mutex_unlock(&ctx->ResLock[j].lock);
+    }
+}
+
+// Takes the spin lock, spinning while it is taken for the budget its recent waits suggest and then parking
+// on its word until the holder releases it
+void spin_lock(struct rm_ctx *ctx, struct spin_lock *lock) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong_explicit(&lock->word, &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+
+    int estimate = atomic_load_explicit(&lock->spins, memory_order_relaxed);
+    int budget = spin_budget(ctx, estimate);
+    for (int spins = 1; spins <= budget; spins++) {
+        CPU_PAUSE();
+        expected = 0;
+        if (atomic_load_explicit(&lock->word, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(&lock->word, &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+            atomic_store_explicit(&lock->spins, estimate + (spins - estimate) / 8, memory_order_relaxed);
+            return;
+        }
+    }
+    atomic_store_explicit(&lock->spins, estimate - estimate / 8, memory_order_relaxed); // The hold outlasted the budget
+
+    // The word stays 2 while threads may be parked, so that the holder wakes one when it releases the lock
+    while (atomic_exchange_explicit(&lock->word, 2, memory_order_acquire) != 0) {
+        futex_wait(&lock->word, 2, NULL);
+    }
+}
+
+void spin_unlock(struct spin_lock *lock) {
+    if (atomic_exchange_explicit(&lock->word, 0, memory_order_release) == 2) {
+        futex_wake(&lock->word, 1);
+    }
+}
+
+// returns the num of spins a wait with the estimate may take before it parks
+int spin_budget(struct rm_ctx *ctx, int estimate) {
+    int budget = 2 * estimate + SPIN_MIN;
+    return (budget < ctx->SpinMax) ? budget : ctx->SpinMax;
+}
+
+// Waits in adaptive wait mode until the waiting request of the thread is granted or aborted, first spinning
+// and then parked on its WakeSeq; the mutex is held on entry and on return but not while waiting
+// returns 0 when woken (or on a spurious wakeup), ETIMEDOUT if the absolute monotonic time until passed and
+// the error of the futex if the wait failed
+int spin_wait(struct rm_ctx *ctx, int tid, const struct timespec *until) {
+    int seq = atomic_load_explicit(&ctx->WakeSeq[tid], memory_order_relaxed);
+    spin_unlock(&ctx->SpinMutex);
+
+    int waited = 0;
+    int estimate = atomic_load_explicit(&ctx->WaitSpins, memory_order_relaxed);
+    int budget = spin_budget(ctx, estimate);
+    int spins = 1;
+    while (spins <= budget && atomic_load_explicit(&ctx->WakeSeq[tid], memory_order_acquire) == seq) {
+        CPU_PAUSE();
+        spins++;
+    }
+
+    if (spins <= budget) {
+        atomic_store_explicit(&ctx->WaitSpins, estimate + (spins - estimate) / 8, memory_order_relaxed);
+    }
+    else {
+        atomic_store_explicit(&ctx->WaitSpins, estimate - estimate / 8, memory_order_relaxed);
+
+        // Parked is set before WakeSeq is checked again and wake_thread reads it after the increment, so
+        // either the thread sees the increment or wake_thread sees Parked
+        atomic_store(&ctx->Parked[tid], 1);
+        while (waited == 0 && atomic_load(&ctx->WakeSeq[tid]) == seq) {
+            waited = futex_wait(&ctx->WakeSeq[tid], seq, until);
+        }
+        atomic_store_explicit(&ctx->Parked[tid], 0, memory_order_relaxed);
+    }
+
+    spin_lock(ctx, &ctx->SpinMutex);
+
+    return waited;
+}
+
+// Wakes the thread waiting in wait_granted, whose request was granted or aborted; called with the mutex held
+void wake_thread(struct rm_ctx *ctx, int tid) {
+    if (ctx->WaitMode == RM_WAIT_BLOCK) {
+        pthread_cond_signal(&ctx->WaitCond[tid]);
+        return;
+    }
+
+    atomic_fetch_add(&ctx->WakeSeq[tid], 1);
+    if (atomic_load(&ctx->Parked[tid]) == 1) {
+        futex_wake(&ctx->WakeSeq[tid], 1);
+    }
+}
+
+// Parks the calling thread while the word is value, until it is woken or until the absolute monotonic time
+// until (NULL if none); returns 0 when woken, on a signal or if the word was not value, ETIMEDOUT if until
+// passed and the error of the futex otherwise
+int futex_wait(atomic_int *word, int value, const struct timespec *until) {
+    if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE, value, until, NULL, FUTEX_BITSET_MATCH_ANY) == -1 &&
+        errno != EAGAIN && errno != EINTR) {
+        return errno;
+    }
+
+    return 0;
+}
+
+void futex_wake(atomic_int *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Repairs the state after the owner of the mutex died while changing it: the available resources and the
+// needs are derived from the allocations and the max demands again, and the ids of dead processes are
+// ended. The wait lists are taken as they are, since they cannot be derived from the rest of the state
+void repair_state(struct rm_ctx *ctx) {
+    lock_all_types(ctx);
+
+    int granted = apply_journal(ctx); // The grant the owner died in
+    derive_state(ctx);
+
+    unlock_all_types(ctx);
+
+    if (granted != -1) {
+        grant_waiter(ctx, granted);
+    }
+
+    reap_dead(ctx);
+}
+
+// Undoes the grant in the journal, or completes its request if the grant was already decided
+// returns the thread whose waiting request the grant completed, -1 if none
+int apply_journal(struct rm_ctx *ctx) {
+    int granted = -1;
+    int tid = atomic_load(&ctx->GrantTid);
+    if (tid != -1 && atomic_load(&ctx->GrantDecided) == 0) {
+        memcpy(ctx->AllocationMat[tid], ctx->GrantAlloc, ctx->RowStride * sizeof(int));
+    }
+    else if (tid != -1) {
+        memset(ctx->RequestMat[tid], 0, ctx->RowStride * sizeof(int));
+        granted = (ctx->Waiting[tid] == 1) ? tid : -1;
+    }
+    atomic_store(&ctx->GrantTid, -1);
+
+    return granted;
+}
+
+// Derives the available resources and the needs from the allocations and the max demands
+void derive_state(struct rm_ctx *ctx) {
+    memcpy(ctx->AvailableRes, ctx->ExistingRes, ctx->RowStride * sizeof(int));
+    for (int i = 0; i < ctx->N; i++) {
+        Vec.sub(ctx->AvailableRes, ctx->AllocationMat[i], ctx->RowStride);
+        if (ctx->DA == 1) {
+            memcpy(ctx->NeedMat[i], ctx->MaxDemandMat[i], ctx->RowStride * sizeof(int));
+            Vec.sub(ctx->NeedMat[i], ctx->AllocationMat[i], ctx->RowStride);
+        }
+    }
+    ctx->NeedBoundStale = 1;
+    ctx->SafeLen = 0;
+}
+
+// Records that the request of the thread is being granted (instances in a segment only)
+void journal_begin(struct rm_ctx *ctx, int tid) {
+    if (ctx->Segment == NULL) {
+        return;
+    }
+
+    memcpy(ctx->GrantAlloc, ctx->AllocationMat[tid], ctx->RowStride * sizeof(int));
+    atomic_store_explicit(&ctx->GrantDecided, 0, memory_order_relaxed);
+    atomic_store_explicit(&ctx->GrantTid, tid, memory_order_release);
+}
+
+void journal_decided(struct rm_ctx *ctx) {
+    if (ctx->Segment != NULL) {
+        atomic_store_explicit(&ctx->GrantDecided, 1, memory_order_release);
+    }
+}
+
+void journal_end(struct rm_ctx *ctx) {
+    if (ctx->Segment != NULL) {
+        atomic_store_explicit(&ctx->GrantTid, -1, memory_order_release);
+    }
+}
+
+// returns 1 if the process no longer runs, 0 otherwise
+int process_gone(pid_t pid) {
+    if (kill(pid, 0) == -1 && errno == ESRCH) {
+        return 1;
+    }
+
+    // A process that exited stays a zombie until its parent waits for it
+    char path[64];
+    char line[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char *state = NULL;
+    if (fgets(line, sizeof(line), file) != NULL) {
+        state = strrchr(line, ')'); // The name of the process may contain spaces and parentheses
+    }
+    fclose(file);
+
+    return state != NULL && (state[1] == ' ') && (state[2] == 'Z' || state[2] == 'X');
+}
+
+// Ends the started ids of processes that no longer exist: their waiting requests are given up and what
+// they hold returns to the available pool. Called with the mutex held
+// returns the num of ended ids
+int reap_dead(struct rm_ctx *ctx) {
+    if (ctx->Shared == 0) {
+        return 0;
+    }
+
+    pid_t self = getpid();
+    pid_t alive = self; // Last process found alive, most ids of a process are next to each other
+    int reaped = 0;
+
+    lock_all_types(ctx);
+    memset(ctx->Freed, 0, ctx->RowStride * sizeof(int));
+
+    for (int i = 0; i < ctx->N; i++) {
+        pid_t owner = ctx->Owner[i];
+        if (ctx->ThreadFinish[i] == 1 || owner == alive || owner == 0) {
+            continue;
+        }
+        if (!process_gone(owner)) {
+            alive = owner;
+            continue;
+        }
+
+        if (ctx->Waiting[i] == 1) {
+            wait_unlink(ctx, i);
+            order_remove(ctx, i);
+            ctx->Waiting[i] = 0;
+            ctx->Detached[i] = 0;
+            if (ctx->DA == 0) {
+                atomic_fetch_sub(&ctx->NumWaiters, 1);
+            }
+        }
+
+        Vec.add(ctx->Freed, ctx->AllocationMat[i], ctx->RowStride);
+        Vec.add(ctx->AvailableRes, ctx->AllocationMat[i], ctx->RowStride);
+        memset(ctx->AllocationMat[i], 0, ctx->RowStride * sizeof(int));
+        memset(ctx->RequestMat[i], 0, ctx->RowStride * sizeof(int));
+        if (ctx->DA == 1) {
+            memcpy(ctx->NeedMat[i], ctx->MaxDemandMat[i], ctx->RowStride * sizeof(int));
+        }
+        ctx->ThreadFinish[i] = 1;
+        ctx->Bound[i] = 0;
+        ctx->Aborted[i] = 0;
+        init_wait_cond(ctx, i); // A waiter that died may have left the condition variable in use
+        reaped++;
+    }
+    if (reaped > 0) {
+        ctx->NeedBoundStale = 1;
+    }
+
+    unlock_all_types(ctx);
+
+    if (reaped > 0) {
+        wake_waiters(ctx, ctx->Freed);
+    }
+
+    return reaped;
+}
+
+// Initializes the condition variable of the thread; deadlines of timed requests are measured on the
+// monotonic clock
+void init_wait_cond(struct rm_ctx *ctx, int tid) {
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    if (ctx->Shared == 1) {
+        pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    }
+
+    pthread_cond_init(&ctx->WaitCond[tid], &condAttr);
+
+    pthread_condattr_destroy(&condAttr);
+}
+
+void unlock_mutex(struct rm_ctx *ctx) {
+    mutex_hold_end(ctx);
+    if (ctx->WaitMode == RM_WAIT_ADAPTIVE) {
+        spin_unlock(&ctx->SpinMutex);
+    }
+    else {
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+}
+
+// Start and end of holding the mutex, also used around the waits that release it
+void mutex_hold_begin(struct rm_ctx *ctx) {
+    atomic_store_explicit(&ctx->StateSeq, atomic_load_explicit(&ctx->StateSeq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (atomic_load_explicit(&ctx->StatsTiming, memory_order_relaxed)) {
+        mutexLockedAt = clock_ns();
+    }
+}
+
+void mutex_hold_end(struct rm_ctx *ctx) {
+    if (mutexLockedAt != 0) {
+        int tid = caller_id(ctx);
+        if (tid != -1) {
+            STAT_ADD(ctx, tid, mutexHeldNs, clock_ns() - mutexLockedAt);
+        }
+        mutexLockedAt = 0;
+    }
+
+    atomic_store_explicit(&ctx->StateSeq, atomic_load_explicit(&ctx->StateSeq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Copies the state into the snapshot; the caller holds the locks or validates the copy with the seqs
+void copy_state(struct rm_ctx *ctx, void *dst) {
+    struct rm_snapshot *snap = dst;
+    size_t rowBytes = (size_t) ctx->M * sizeof(int);
+
+    memcpy(snap->existing, ctx->ExistingRes, rowBytes);
+    memcpy(snap->available, ctx->AvailableRes, rowBytes);
+    memcpy(snap->finished, ctx->ThreadFinish, (size_t) ctx->N * sizeof(int));
+    for (int i = 0; i < ctx->N; i++) {
+        memcpy(snap->allocation + (size_t) i * ctx->M, ctx->AllocationMat[i], rowBytes);
+        memcpy(snap->request + (size_t) i * ctx->M, ctx->RequestMat[i], rowBytes);
+        memcpy(snap->max_demand + (size_t) i * ctx->M, ctx->MaxDemandMat[i], rowBytes);
+        memcpy(snap->need + (size_t) i * ctx->M, ctx->NeedMat[i], rowBytes);
+    }
+}
+
+// Copies what the detection reads into the instance at dst, which has the same sizes
+void copy_detection_state(struct rm_ctx *ctx, void *dst) {
+    struct rm_ctx *copy = dst;
+    size_t rowBytes = (size_t) ctx->RowStride * sizeof(int);
+
+    memcpy(copy->AvailableRes, ctx->AvailableRes, rowBytes);
+    memcpy(copy->ThreadFinish, ctx->ThreadFinish, (size_t) ctx->N * sizeof(int));
+    for (int i = 0; i < ctx->N; i++) {
+        memcpy(copy->AllocationMat[i], ctx->AllocationMat[i], rowBytes);
+        memcpy(copy->RequestMat[i], ctx->RequestMat[i], rowBytes);
+    }
+}
+
+// returns the scratch space for the sequence counters that rm_snapshot_create put after the matrices, so
+// threads taking their own snapshots at once do not share it
+unsigned int *snapshot_seqs(struct rm_snapshot *snap) {
+    return (unsigned int *) (snap->need + (size_t) snap->n * snap->m);
+}
+
+// Makes a consistent copy of the state with copy, without the locks while no thread changes the state
+// meanwhile, otherwise under the locks for the time of the copy. seqs (M + 1 entries) gets the sequence
+// counters the copy is consistent with: StateSeq and then the seq of each resource type
+// returns 1 if the copy was made without the locks, 0 if it was made under the locks
+int read_consistent(struct rm_ctx *ctx, void (*copy)(struct rm_ctx *ctx, void *dst), void *dst, unsigned int seqs[]) {
+    for (int attempt = 0; attempt < SNAPSHOT_TRIES; attempt++) {
+        seqs[0] = atomic_load_explicit(&ctx->StateSeq, memory_order_acquire);
+        int busy = seqs[0] & 1;
+        for (int j = 0; j < ctx->M; j++) {
+            seqs[j + 1] = atomic_load_explicit(&ctx->ResLock[j].seq, memory_order_acquire);
+            busy |= seqs[j + 1] & 1;
+        }
+        if (busy) {
+            continue;
+        }
+
+        copy(ctx, dst);
+        atomic_thread_fence(memory_order_acquire);
+
+        int changed = atomic_load_explicit(&ctx->StateSeq, memory_order_relaxed) != seqs[0];
+        for (int j = 0; j < ctx->M && !changed; j++) {
+            changed = atomic_load_explicit(&ctx->ResLock[j].seq, memory_order_relaxed) != seqs[j + 1];
+        }
+        if (!changed) {
+            return 1;
+        }
+    }
+
+    // The state keeps changing, so copy it under the locks (only for the time of the copy)
+    /* critical section start */
+    lock_mutex(ctx);
+    lock_all_types(ctx);
+
+    copy(ctx, dst);
+
+    /* critical section end */
+    unlock_all_types(ctx);
+    unlock_mutex(ctx);
+
+    return 0;
+}
+
+// Prints a vector or the rows of a matrix of the snapshot in the format of rm_print_state
+void print_vector(const char *name, const int vec[], int m) {
+    printf("%s:\n", name);
+    printf("      ");
+    for(int i = 0; i < m; i++) {
+        printf("R%d   ", i);
     }
     printf("\n");
-    for(int i = 0; i < M; i++) {
+    for(int i = 0; i < m; i++) {
         if (i == 0) {
-            printf("%7d", AvailableRes[i]);
+            printf("%7d", vec[i]);
+        }
+        else {
+            printf("%5d", vec[i]);
+        }
+    }
+    printf("\n\n");
+}
+
+void print_matrix(const char *name, const int mat[], int n, int m) {
+    printf("%s:\n", name);
+    printf("      ");
+    for(int i = 0; i < m; i++) {
+        printf("R%d   ", i);
+    }
+    printf("\n");
+    for(int i = 0; i < n; i++) {
+        printf("T%d: ", i);
+        for (int j = 0; j < m; j++) {
+            int value = mat[(size_t) i * m + j];
+            if (j == 0) {
+                if (i / 10 == 0) {
+                    printf("%3d", value);
+                }
+                else {
+                    printf("%2d", value);
+                }
+            }
+            else {
+                printf("%5d", value);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Counts a granted request in the statistics of its resource types
+// The locks of the types (detection mode) or the mutex (avoidance mode) must be held
+void count_grant(struct rm_ctx *ctx, int request[]) {
+    for (int i = 0; i < ctx->M; i++) {
+        if (request[i] != 0) {
+            ctx->ResLock[i].grants++;
+            ctx->ResLock[i].units += request[i];
+        }
+    }
+}
+
+// Takes the locks of all resource types in detection mode so that the whole state can be read consistently
+// The mutex must be held by the caller
+void lock_all_types(struct rm_ctx *ctx) {
+    if (ctx->DA != 0) {
+        return;
+    }
+
+    for (int i = 0; i < ctx->M; i++) {
+        lock_type(ctx, i);
+    }
+}
+
+void unlock_all_types(struct rm_ctx *ctx) {
+    if (ctx->DA != 0) {
+        return;
+    }
+
+    for (int i = ctx->M - 1; i >= 0; i--) {
+        unlock_type(ctx, i);
+    }
+}
+
+// returns 1 if the resources left after granting the request of the thread cover NeedBound, 0 otherwise
+int fits_need_bound(struct rm_ctx *ctx, int tid) {
+    for (int i = 0; i < ctx->M; i++) {
+        if (ctx->AvailableRes[i] - ctx->RequestMat[tid][i] < ctx->NeedBound[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Raises NeedBound to cover the need of the thread
+void raise_need_bound(struct rm_ctx *ctx, int tid) {
+    Vec.max(ctx->NeedBound, ctx->NeedMat[tid], ctx->RowStride);
+}
+
+// Appends the thread to the end of the given wait list and marks it as waiting
+void wait_enqueue(struct rm_ctx *ctx, int tid, int list) {
+    ctx->Waiting[tid] = 1;
+    ctx->WaitOn[tid] = list;
+    ctx->WaitNext[tid] = -1;
+    ctx->WaitPrev[tid] = ctx->WaitTail[list];
+
+    if (ctx->WaitTail[list] == -1) {
+        ctx->WaitHead[list] = tid;
+    }
+    else {
+        ctx->WaitNext[ctx->WaitTail[list]] = tid;
+    }
+    ctx->WaitTail[list] = tid;
+}
+
+// Removes the thread from the wait list it is in
+void wait_unlink(struct rm_ctx *ctx, int tid) {
+    int list = ctx->WaitOn[tid];
+
+    if (ctx->WaitPrev[tid] == -1) {
+        ctx->WaitHead[list] = ctx->WaitNext[tid];
+    }
+    else {
+        ctx->WaitNext[ctx->WaitPrev[tid]] = ctx->WaitNext[tid];
+    }
+
+    if (ctx->WaitNext[tid] == -1) {
+        ctx->WaitTail[list] = ctx->WaitPrev[tid];
+    }
+    else {
+        ctx->WaitPrev[ctx->WaitNext[tid]] = ctx->WaitPrev[tid];
+    }
+}
+
+// Grants the waiting requests of the given wait list that can be granted now and signals their threads
+void wake_list(struct rm_ctx *ctx, int list) {
+    int tid = ctx->WaitHead[list];
+
+    while (tid != -1) {
+        int next = ctx->WaitNext[tid];
+
+        // A thread moved to a later list in this round was already checked
+        if (ctx->WaitRound[tid] != ctx->wakeRound) {
+            ctx->WaitRound[tid] = ctx->wakeRound;
+
+            int newList = try_grant(ctx, tid);
+            if (newList == -1) {
+                grant_waiter(ctx, tid);
+            }
+            else if (newList != list) {
+                wait_unlink(ctx, tid);
+                wait_enqueue(ctx, tid, newList);
+            }
+        }
+
+        tid = next;
+    }
+}
+
+// Grants the waiting requests that can be granted after the available resources of the types with a
+// nonzero entry in released grew (released may be NULL if only the safety of the state changed).
+// Only the threads short on those types and, in avoidance mode, the threads held back by the safety
+// check are checked, so a release no longer wakes threads whose requests still cannot be granted
+void wake_waiters(struct rm_ctx *ctx, int released[]) {
+    // Ordered grants check the waiting requests in the order of the policy instead
+    if (atomic_load_explicit(&ctx->Ordered, memory_order_relaxed) == 1) {
+        wake_ordered(ctx);
+        return;
+    }
+
+    ctx->wakeRound++;
+
+    if (released != NULL) {
+        for (int j = 0; j < ctx->M; j++) {
+            if (released[j] != 0) {
+                wake_list(ctx, j);
+            }
+        }
+    }
+
+    // The unsafe list is only used by detection mode for requests held back by an earlier policy
+    if (ctx->DA == 1 || ctx->WaitHead[WAIT_UNSAFE(ctx)] != -1) {
+        wake_list(ctx, WAIT_UNSAFE(ctx));
+    }
+}
+
+// Grants the waiting requests in the order of the policy. A request that cannot be granted is skipped
+// and counts as bypassed by each later arrived request granted after it; the requests that arrived after
+// the oldest request at the bypass limit are only granted to threads holding resources
+void wake_ordered(struct rm_ctx *ctx) {
+    int skipped = 0;
+    long long limitArrival = oldest_at_limit(ctx);
+
+    int tid = ctx->OrderHead;
+    while (tid != -1) {
+        int next = ctx->OrderNext[tid];
+
+        if (ctx->Arrival[tid] <= limitArrival || Vec.nonzero(ctx->AllocationMat[tid], ctx->RowStride)) {
+            int newList = try_grant(ctx, tid);
+            if (newList == -1) {
+                grant_waiter(ctx, tid);
+
+                // Count the bypass of the skipped requests that arrived before
+                for (int k = 0; ctx->MaxBypass >= 0 && k < skipped; k++) {
+                    int s = ctx->Skipped[k];
+                    if (ctx->Arrival[s] < ctx->Arrival[tid] && ++ctx->Bypass[s] >= ctx->MaxBypass &&
+                        ctx->Arrival[s] < limitArrival) {
+                        limitArrival = ctx->Arrival[s];
+                    }
+                }
+
+                // The request at the limit is granted, so the requests held back for it are checked again
+                if (ctx->Arrival[tid] == limitArrival) {
+                    limitArrival = oldest_at_limit(ctx);
+                    skipped = 0;
+                    tid = ctx->OrderHead;
+                    continue;
+                }
+            }
+            else {
+                if (newList != ctx->WaitOn[tid]) {
+                    wait_unlink(ctx, tid);
+                    wait_enqueue(ctx, tid, newList);
+                }
+
+                ctx->Skipped[skipped++] = tid;
+            }
+        }
+
+        tid = next;
+    }
+}
+
+// returns the arrival of the oldest waiting request that reached the bypass limit, LLONG_MAX if there is none
+long long oldest_at_limit(struct rm_ctx *ctx) {
+    long long oldest = LLONG_MAX;
+
+    if (ctx->MaxBypass < 0) {
+        return oldest;
+    }
+
+    for (int w = ctx->OrderHead; w != -1; w = ctx->OrderNext[w]) {
+        if (ctx->Bypass[w] >= ctx->MaxBypass && ctx->Arrival[w] < oldest) {
+            oldest = ctx->Arrival[w];
+        }
+    }
+
+    return oldest;
+}
+
+// Removes the granted request of the thread from the wait lists and signals the thread
+void grant_waiter(struct rm_ctx *ctx, int tid) {
+    wait_unlink(ctx, tid);
+    order_remove(ctx, tid);
+    ctx->Waiting[tid] = 0;
+    if (ctx->Detached[tid] == 1) {
+        complete_detached(ctx, tid, 0);
+    }
+    else {
+        wake_thread(ctx, tid);
+    }
+}
+
+// returns 1 if the thread is a started thread without a waiting request or a queued completion, 0 otherwise
+int async_idle(struct rm_ctx *ctx, int tid) {
+    if (tid < 0 || tid >= ctx->N) {
+        return 0;
+    }
+
+    /* critical section start */
+    lock_mutex(ctx);
+
+    int idle = ctx->ThreadFinish[tid] == 0 && ctx->Waiting[tid] == 0 && ctx->DonePending[tid] == 0;
+
+    /* critical section end */
+    unlock_mutex(ctx);
+
+    return idle;
+}
+
+// Queues the result of the detached request of the thread whose wait ended for rm_async_poll; called with
+// the mutex held
+void complete_detached(struct rm_ctx *ctx, int tid, int result) {
+    ctx->Detached[tid] = 0;
+    ctx->DoneIds[(ctx->DoneHead + ctx->DoneCount) % ctx->N] = tid;
+    ctx->DoneResult[(ctx->DoneHead + ctx->DoneCount) % ctx->N] = result;
+    ctx->DoneCount++;
+    ctx->DonePending[tid] = 1;
+
+    // Signal the fd when the queue becomes non-empty; the caller polls until the queue is empty
+    if (ctx->DoneCount == 1 && ctx->AsyncFd != -1) {
+        uint64_t one = 1;
+        ssize_t written = write(ctx->AsyncFd, &one, sizeof(one)); // Only fails if the counter is full
+        (void) written;
+    }
+
+    if (ctx->DA == 0) {
+        atomic_fetch_sub(&ctx->NumWaiters, 1);
+    }
+    if (result == 0) {
+        STAT_ADD(ctx, tid, grants, 1);
+        trace_event(ctx, RM_TRACE_REQUEST, tid, ctx->AsyncReq + (size_t) tid * ctx->RowStride, ctx->AsyncAt[tid]);
+    }
+}
+
+// Sets the arrival and the size of the request in RequestMat, which place it in the policy order
+void order_key(struct rm_ctx *ctx, int tid) {
+    long long size = 0;
+    for (int i = 0; i < ctx->M; i++) {
+        size += ctx->RequestMat[tid][i];
+    }
+
+    ctx->Arrival[tid] = ++ctx->ArrivalSeq;
+    ctx->ReqSize[tid] = size;
+}
+
+// returns 1 if the policy serves the request of thread a before the request of thread b, 0 otherwise
+int order_before(struct rm_ctx *ctx, int a, int b) {
+    if (ctx->Policy == RM_POLICY_PRIORITY && ctx->Priority[a] != ctx->Priority[b]) {
+        return ctx->Priority[a] > ctx->Priority[b];
+    }
+    if (ctx->Policy == RM_POLICY_SMALLEST && ctx->ReqSize[a] != ctx->ReqSize[b]) {
+        return ctx->ReqSize[a] < ctx->ReqSize[b];
+    }
+
+    return ctx->Arrival[a] < ctx->Arrival[b];
+}
+
+// Adds the waiting thread to the policy order (searching from the end, so arrival order takes O(1))
+void order_insert(struct rm_ctx *ctx, int tid) {
+    int prev = ctx->OrderTail;
+    while (prev != -1 && order_before(ctx, tid, prev)) {
+        prev = ctx->OrderPrev[prev];
+    }
+
+    int next = (prev == -1) ? ctx->OrderHead : ctx->OrderNext[prev];
+    ctx->OrderPrev[tid] = prev;
+    ctx->OrderNext[tid] = next;
+    if (prev == -1) {
+        ctx->OrderHead = tid;
+    }
+    else {
+        ctx->OrderNext[prev] = tid;
+    }
+    if (next == -1) {
+        ctx->OrderTail = tid;
+    }
+    else {
+        ctx->OrderPrev[next] = tid;
+    }
+
+    ctx->Bypass[tid] = 0;
+}
+
+void order_remove(struct rm_ctx *ctx, int tid) {
+    if (ctx->OrderPrev[tid] == -1) {
+        ctx->OrderHead = ctx->OrderNext[tid];
+    }
+    else {
+        ctx->OrderNext[ctx->OrderPrev[tid]] = ctx->OrderNext[tid];
+    }
+
+    if (ctx->OrderNext[tid] == -1) {
+        ctx->OrderTail = ctx->OrderPrev[tid];
+    }
+    else {
+        ctx->OrderPrev[ctx->OrderNext[tid]] = ctx->OrderPrev[tid];
+    }
+}
+
+// returns 1 if the new request of the thread must wait since a waiting request reached the bypass limit,
+// 0 otherwise. Threads holding resources and empty requests are never held back, so the policy cannot
+// make a thread wait for resources held by a thread waiting behind it
+int held_back(struct rm_ctx *ctx, int tid) {
+    if (atomic_load_explicit(&ctx->Ordered, memory_order_relaxed) == 0 || ctx->MaxBypass < 0 ||
+        ctx->ReqSize[tid] == 0 || Vec.nonzero(ctx->AllocationMat[tid], ctx->RowStride)) {
+        return 0;
+    }
+
+    return oldest_at_limit(ctx) != LLONG_MAX;
+}
+
+// Counts the bypass of the waiting requests by a granted new request
+void count_bypass(struct rm_ctx *ctx) {
+    if (atomic_load_explicit(&ctx->Ordered, memory_order_relaxed) == 0 || ctx->MaxBypass < 0) {
+        return;
+    }
+
+    for (int w = ctx->OrderHead; w != -1; w = ctx->OrderNext[w]) {
+        ctx->Bypass[w]++;
+    }
+}
+
+// Allocates the state of n threads and m resource types, releasing the state of a previous rm_init
+// The vectors and matrices share one cache line aligned block, each row starting on a new cache line
+// so that a thread's row spans only the cache lines it uses; rows are zero filled including padding
+// returns 0 on success, -1 if the memory could not be allocated
+int alloc_state(struct rm_ctx *ctx, int n, int m) {
+    size_t stride = ((size_t) m + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+    size_t finishInts = ((size_t) n + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+
+    // Existing and Available vectors, ThreadFinish, then allocation, request, max demand and need matrices
+    if ((size_t) n > (SIZE_MAX / sizeof(int) - finishInts - 2 * stride) / (4 * stride)) {
+        return -1;
+    }
+    size_t blockInts = 2 * stride + finishInts + 4 * (size_t) n * stride;
+
+    free_state(ctx);
+
+    void *block;
+    if (state_memalign(ctx, &block, blockInts * sizeof(int)) != 0) {
+        return -1;
+    }
+    ctx->StateBlock = block;
+    memset(ctx->StateBlock, 0, blockInts * sizeof(int));
+
+    if (state_memalign(ctx, &block, (size_t) m * sizeof(struct res_lock)) != 0) {
+        free_state(ctx);
+        return -1;
+    }
+    ctx->ResLock = block;
+
+    if (state_memalign(ctx, &block, (size_t) n * sizeof(struct thread_stats)) != 0) {
+        free_state(ctx);
+        return -1;
+    }
+    ctx->Stats = block;
+    memset(ctx->Stats, 0, (size_t) n * sizeof(struct thread_stats));
+
+    ctx->RowTable = state_malloc(ctx, 4 * (size_t) n * sizeof(int *));
+    ctx->threadList = state_malloc(ctx, (size_t) n * sizeof(pthread_t));
+    ctx->WaitCond = state_malloc(ctx, (size_t) n * sizeof(pthread_cond_t));
+    ctx->Waiting = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WaitOn = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WaitNext = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WaitPrev = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WaitRound = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WaitHead = state_malloc(ctx, ((size_t) m + 1) * sizeof(int));
+    ctx->WaitTail = state_malloc(ctx, ((size_t) m + 1) * sizeof(int));
+    ctx->NeedBound = state_calloc(ctx, stride, sizeof(int));
+    ctx->Work = state_calloc(ctx, stride, sizeof(int));
+    ctx->BlockIdx = state_malloc(ctx, stride * sizeof(int));
+    ctx->FinishTemp = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->BlockCount = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->WorkList = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->BlockStart = state_malloc(ctx, ((size_t) m + 1) * sizeof(int));
+    ctx->BlockPos = state_malloc(ctx, (size_t) m * sizeof(int));
+    ctx->BlockList = state_malloc(ctx, (size_t) n * m * sizeof(struct block_entry));
+    ctx->DeadlockIds = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->SafeSeq = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->ParCand = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->ParFits = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->Owner = state_calloc(ctx, (size_t) n, sizeof(pid_t));
+    ctx->Bound = state_calloc(ctx, (size_t) n, sizeof(int));
+    ctx->GrantAlloc = state_calloc(ctx, stride, sizeof(int));
+    ctx->WakeSeq = state_calloc(ctx, (size_t) n, sizeof(atomic_int));
+    ctx->Parked = state_calloc(ctx, (size_t) n, sizeof(atomic_int));
+    ctx->Visited = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->TypeSeen = state_malloc(ctx, (size_t) m * sizeof(int));
+    ctx->Priority = state_calloc(ctx, (size_t) n, sizeof(int));
+    ctx->Arrival = state_malloc(ctx, (size_t) n * sizeof(long long));
+    ctx->ReqSize = state_malloc(ctx, (size_t) n * sizeof(long long));
+    ctx->Bypass = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->OrderNext = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->OrderPrev = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->Skipped = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->Aborted = state_calloc(ctx, (size_t) n, sizeof(int));
+    ctx->Started = state_calloc(ctx, (size_t) n, sizeof(long long));
+    ctx->RecoverIds = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->Freed = state_calloc(ctx, stride, sizeof(int));
+    ctx->Detached = state_calloc(ctx, (size_t) n, sizeof(int));
+    ctx->Ticket = state_calloc(ctx, (size_t) n, sizeof(unsigned long long));
+    ctx->AsyncAt = state_calloc(ctx, (size_t) n, sizeof(long long));
+    ctx->AsyncReq = state_calloc(ctx, (size_t) n * stride, sizeof(int));
+    ctx->DoneIds = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->DoneResult = state_malloc(ctx, (size_t) n * sizeof(int));
+    ctx->DonePending = state_calloc(ctx, (size_t) n, sizeof(int));
+    ctx->BatchScratch = state_malloc(ctx, 3 * (size_t) n * stride * sizeof(int));
+    ctx->DetectSeqs = state_malloc(ctx, ((size_t) m + 1) * sizeof(unsigned int));
+
+    if (ctx->RowTable == NULL || ctx->threadList == NULL || ctx->WaitCond == NULL || ctx->Waiting == NULL || ctx->WaitOn == NULL ||
+        ctx->WaitNext == NULL || ctx->WaitPrev == NULL || ctx->WaitRound == NULL || ctx->WaitHead == NULL || ctx->WaitTail == NULL ||
+        ctx->NeedBound == NULL || ctx->Work == NULL || ctx->BlockIdx == NULL || ctx->FinishTemp == NULL || ctx->BlockCount == NULL || ctx->WorkList == NULL ||
+        ctx->BlockStart == NULL || ctx->BlockPos == NULL || ctx->BlockList == NULL ||
+        ctx->DeadlockIds == NULL || ctx->Visited == NULL || ctx->TypeSeen == NULL || ctx->Priority == NULL ||
+        ctx->Arrival == NULL || ctx->ReqSize == NULL || ctx->Bypass == NULL || ctx->OrderNext == NULL ||
+        ctx->OrderPrev == NULL || ctx->Skipped == NULL || ctx->Aborted == NULL || ctx->Started == NULL ||
+        ctx->RecoverIds == NULL || ctx->Freed == NULL || ctx->Detached == NULL || ctx->Ticket == NULL || ctx->AsyncAt == NULL || ctx->AsyncReq == NULL || ctx->DoneIds == NULL ||
+        ctx->DoneResult == NULL || ctx->DonePending == NULL || ctx->SafeSeq == NULL ||
+        ctx->ParCand == NULL || ctx->ParFits == NULL || ctx->Owner == NULL || ctx->Bound == NULL ||
+        ctx->GrantAlloc == NULL || ctx->WakeSeq == NULL || ctx->Parked == NULL || ctx->BatchScratch == NULL ||
+        ctx->DetectSeqs == NULL) {
+        free_state(ctx);
+        return -1;
+    }
+
+    ctx->RowStride = (int) stride;
+    ctx->ExistingRes = ctx->StateBlock;
+    ctx->AvailableRes = ctx->StateBlock + stride;
+    ctx->ThreadFinish = ctx->StateBlock + 2 * stride;
+
+    ctx->AllocationMat = ctx->RowTable;
+    ctx->RequestMat = ctx->RowTable + n;
+    ctx->MaxDemandMat = ctx->RowTable + 2 * n;
+    ctx->NeedMat = ctx->RowTable + 3 * n;
+
+    int *matrices = ctx->ThreadFinish + finishInts;
+    for (int i = 0; i < 4 * n; i++) {
+        ctx->RowTable[i] = matrices + (size_t) i * stride;
+    }
+
+    return 0;
+}
+
+// Allocation of the state, from the segment of a shared instance and from the heap otherwise
+// Memory of a segment is zero filled and only returned with the segment
+
+// returns size bytes of the segment on a cache line boundary, NULL if the segment is full
+void *segment_alloc(struct rm_segment *seg, size_t size) {
+    size_t at = (seg->used + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (at > seg->size || size > seg->size - at) {
+        return NULL;
+    }
+    seg->used = at + size;
+
+    return (char *) seg + at;
+}
+
+void *state_malloc(struct rm_ctx *ctx, size_t size) {
+    return (ctx->Segment == NULL) ? malloc(size) : segment_alloc(ctx->Segment, size);
+}
+
+void *state_calloc(struct rm_ctx *ctx, size_t count, size_t size) {
+    if (ctx->Segment == NULL) {
+        return calloc(count, size);
+    }
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    return segment_alloc(ctx->Segment, count * size);
+}
+
+// returns 0 and a cache line aligned block in block on success, -1 if there is no memory
+int state_memalign(struct rm_ctx *ctx, void **block, size_t size) {
+    if (ctx->Segment == NULL) {
+        return (posix_memalign(block, CACHE_LINE, size) == 0) ? 0 : -1;
+    }
+
+    *block = segment_alloc(ctx->Segment, size);
+    return (*block == NULL) ? -1 : 0;
+}
+
+void state_free(struct rm_ctx *ctx, void *p) {
+    if (ctx->Segment == NULL) {
+        free(p);
+    }
+}
+
+// Releases the state allocated by alloc_state (no thread may be using the library)
+void free_state(struct rm_ctx *ctx) {
+    if (ctx->WaitCond != NULL) {
+        for (int i = 0; i < ctx->N; i++) {
+            pthread_cond_destroy(&ctx->WaitCond[i]);
         }
-        else {
-            printf("%5d", AvailableRes[i]);
+    }
+
+    if (ctx->ResLock != NULL) {
+        for (int j = 0; j < ctx->M; j++) {
+            pthread_mutex_destroy(&ctx->ResLock[j].lock);
         }
     }
-    printf("\n\n");
 
-    printf("Allocation:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    state_free(ctx, ctx->StateBlock);
+    state_free(ctx, ctx->ResLock);
+    state_free(ctx, ctx->Stats);
+    state_free(ctx, ctx->RowTable);
+    state_free(ctx, ctx->threadList);
+    state_free(ctx, ctx->WaitCond);
+    state_free(ctx, ctx->Waiting);
+    state_free(ctx, ctx->WaitOn);
+    state_free(ctx, ctx->WaitNext);
+    state_free(ctx, ctx->WaitPrev);
+    state_free(ctx, ctx->WaitRound);
+    state_free(ctx, ctx->WaitHead);
+    state_free(ctx, ctx->WaitTail);
+    state_free(ctx, ctx->NeedBound);
+    state_free(ctx, ctx->Work);
+    state_free(ctx, ctx->BlockIdx);
+    state_free(ctx, ctx->FinishTemp);
+    state_free(ctx, ctx->BlockCount);
+    state_free(ctx, ctx->WorkList);
+    state_free(ctx, ctx->BlockStart);
+    state_free(ctx, ctx->BlockPos);
+    state_free(ctx, ctx->BlockList);
+    state_free(ctx, ctx->DeadlockIds);
+    state_free(ctx, ctx->SafeSeq);
+    state_free(ctx, ctx->ParCand);
+    state_free(ctx, ctx->ParFits);
+    state_free(ctx, ctx->Owner);
+    state_free(ctx, ctx->Bound);
+    state_free(ctx, ctx->GrantAlloc);
+    state_free(ctx, ctx->WakeSeq);
+    state_free(ctx, ctx->Parked);
+    state_free(ctx, ctx->Visited);
+    state_free(ctx, ctx->TypeSeen);
+    state_free(ctx, ctx->Priority);
+    state_free(ctx, ctx->Arrival);
+    state_free(ctx, ctx->ReqSize);
+    state_free(ctx, ctx->Bypass);
+    state_free(ctx, ctx->OrderNext);
+    state_free(ctx, ctx->OrderPrev);
+    state_free(ctx, ctx->Skipped);
+    state_free(ctx, ctx->Aborted);
+    state_free(ctx, ctx->Started);
+    state_free(ctx, ctx->RecoverIds);
+    state_free(ctx, ctx->Freed);
+    state_free(ctx, ctx->Detached);
+    state_free(ctx, ctx->Ticket);
+    state_free(ctx, ctx->AsyncAt);
+    state_free(ctx, ctx->AsyncReq);
+    state_free(ctx, ctx->DoneIds);
+    state_free(ctx, ctx->DoneResult);
+    state_free(ctx, ctx->DonePending);
+    state_free(ctx, ctx->BatchScratch);
+    state_free(ctx, ctx->DetectSeqs);
+
+    ctx->StateBlock = NULL;
+    ctx->ResLock = NULL;
+    ctx->Stats = NULL;
+    ctx->RowTable = NULL;
+    ctx->threadList = NULL;
+    ctx->WaitCond = NULL;
+    ctx->Waiting = NULL;
+    ctx->WaitOn = NULL;
+    ctx->WaitNext = NULL;
+    ctx->WaitPrev = NULL;
+    ctx->WaitRound = NULL;
+    ctx->WaitHead = NULL;
+    ctx->WaitTail = NULL;
+    ctx->NeedBound = NULL;
+    ctx->Work = NULL;
+    ctx->BlockIdx = NULL;
+    ctx->FinishTemp = NULL;
+    ctx->BlockCount = NULL;
+    ctx->WorkList = NULL;
+    ctx->BlockStart = NULL;
+    ctx->BlockPos = NULL;
+    ctx->BlockList = NULL;
+    ctx->DeadlockIds = NULL;
+    ctx->SafeSeq = NULL;
+    ctx->ParCand = NULL;
+    ctx->ParFits = NULL;
+    ctx->Owner = NULL;
+    ctx->Bound = NULL;
+    ctx->GrantAlloc = NULL;
+    ctx->WakeSeq = NULL;
+    ctx->Parked = NULL;
+    ctx->Visited = NULL;
+    ctx->TypeSeen = NULL;
+    ctx->Priority = NULL;
+    ctx->Arrival = NULL;
+    ctx->ReqSize = NULL;
+    ctx->Bypass = NULL;
+    ctx->OrderNext = NULL;
+    ctx->OrderPrev = NULL;
+    ctx->Skipped = NULL;
+    ctx->Aborted = NULL;
+    ctx->Started = NULL;
+    ctx->RecoverIds = NULL;
+    ctx->Freed = NULL;
+    ctx->Detached = NULL;
+    ctx->Ticket = NULL;
+    ctx->AsyncAt = NULL;
+    ctx->AsyncReq = NULL;
+    ctx->DoneIds = NULL;
+    ctx->DoneResult = NULL;
+    ctx->DonePending = NULL;
+    ctx->BatchScratch = NULL;
+    ctx->DetectSeqs = NULL;
+}
+
+int compare_block_entry(const void *a, const void *b) {
+    const struct block_entry *x = a;
+    const struct block_entry *y = b;
+
+    if (x->demand != y->demand) {
+        return (x->demand < y->demand) ? -1 : 1;
     }
-    printf("\n");
-    for(int i = 0; i < N; i++) {
-        printf("T%d: ", i);
-        for (int j = 0; j < M; j++) {
-            if (j == 0) {
-                if (i / 10 == 0) {
-                    printf("%3d", AllocationMat[i][j]);
-                }
-                else {
-                    printf("%2d", AllocationMat[i][j]);
-                }
-            }
-            else {
-                printf("%5d", AllocationMat[i][j]);
-            }
+    return x->thread - y->thread;
+}
+
+// Runs the threads that are not finished to completion one by one, starting from the available pool.
+// A thread can run when its Demand row (Need for avoidance, Request for detection) fits in Work, and
+// its allocation is then added to Work. Instead of rescanning all threads whenever Work grows, each
+// thread keeps the number of resource types that still block it, and each resource type keeps its
+// blocked threads sorted by demand, so that growing Work only visits the threads it actually unblocks.
+// Finish is updated in place and, if order is not NULL, the threads are stored in it in the order they
+// were finished; returns the number of threads that could not be finished
+int reduce(struct rm_ctx *ctx, int **Demand, int Finish[], int order[]) {
+    if (ctx->Pool != NULL && (long) ctx->N * ctx->M >= ctx->ParallelMin) {
+        return reduce_parallel(ctx, Demand, Finish, order);
+    }
+
+    int listSize = 0;
+    int finished = 0;
+
+    // Create a work vector and initialize it with available vector
+    memcpy(ctx->Work, ctx->AvailableRes, ctx->RowStride * sizeof(int));
+    for (int j = 0; j < ctx->M; j++) {
+        ctx->BlockStart[j] = 0;
+    }
+
+    // Count the resource types that block each thread and the blocked threads of each resource type
+    int unfinished = 0;
+    int workSize = 0;
+    for (int i = 0; i < ctx->N; i++) {
+        if (Finish[i] == 1) {
+            continue;
+        }
+        unfinished++;
+
+        ctx->BlockCount[i] = Vec.gt_index(Demand[i], ctx->Work, ctx->RowStride, ctx->BlockIdx);
+        for (int b = 0; b < ctx->BlockCount[i]; b++) {
+            ctx->BlockStart[ctx->BlockIdx[b]]++;
+        }
+
+        if (ctx->BlockCount[i] == 0) {
+            ctx->WorkList[workSize++] = i;
         }
-        printf("\n");
     }
-    printf("\n");
 
-    printf("Request:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    // Turn the counts into start offsets in BlockList
+    for (int j = 0; j < ctx->M; j++) {
+        int count = ctx->BlockStart[j];
+        ctx->BlockStart[j] = listSize;
+        ctx->BlockPos[j] = listSize;
+        listSize += count;
     }
-    printf("\n");
-    for(int i = 0; i < N; i++) {
-        printf("T%d: ", i);
-        for (int j = 0; j < M; j++) {
-            if (j == 0) {
-                if (i / 10 == 0) {
-                    printf("%3d", RequestMat[i][j]);
-                }
-                else {
-                    printf("%2d", RequestMat[i][j]);
-                }
-            }
-            else {
-                printf("%5d", RequestMat[i][j]);
-            }
+    ctx->BlockStart[ctx->M] = listSize;
+
+    // Group the blocked threads by resource type
+    for (int i = 0; i < ctx->N; i++) {
+        if (Finish[i] == 1 || ctx->BlockCount[i] == 0) {
+            continue;
+        }
+
+        int count = Vec.gt_index(Demand[i], ctx->Work, ctx->RowStride, ctx->BlockIdx);
+        for (int b = 0; b < count; b++) {
+            int j = ctx->BlockIdx[b];
+            ctx->BlockList[ctx->BlockPos[j]].demand = Demand[i][j];
+            ctx->BlockList[ctx->BlockPos[j]].thread = i;
+            ctx->BlockPos[j]++;
         }
-        printf("\n");
     }
-    printf("\n");
 
-    printf("MaxDemand:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    for (int j = 0; j < ctx->M; j++) {
+        ctx->BlockPos[j] = ctx->BlockStart[j];
+        qsort(&ctx->BlockList[ctx->BlockStart[j]], ctx->BlockStart[j + 1] - ctx->BlockStart[j], sizeof(struct block_entry), compare_block_entry);
     }
-    printf("\n");
-    for(int i = 0; i < N; i++) {
-        printf("T%d: ", i);
-        for (int j = 0; j < M; j++) {
-            if (j == 0) {
-                if (i / 10 == 0) {
-                    printf("%3d", MaxDemandMat[i][j]);
-                }
-                else {
-                    printf("%2d", MaxDemandMat[i][j]);
-                }
+
+    // Finish the threads in the work list, unblocking the threads whose demand the grown Work now covers
+    while (workSize > 0) {
+        int i = ctx->WorkList[--workSize];
+        Finish[i] = 1; // Mark the thread as finished
+        unfinished--;
+        if (order != NULL) {
+            order[finished++] = i;
+        }
+
+        // update work vector
+        Vec.add(ctx->Work, ctx->AllocationMat[i], ctx->RowStride);
+
+        for (int k = 0; k < ctx->M; k++) {
+            if (ctx->AllocationMat[i][k] == 0) {
+                continue;
             }
-            else {
-                printf("%5d", MaxDemandMat[i][j]);
+
+            while (ctx->BlockPos[k] < ctx->BlockStart[k + 1] && ctx->BlockList[ctx->BlockPos[k]].demand <= ctx->Work[k]) {
+                int t = ctx->BlockList[ctx->BlockPos[k]].thread;
+                ctx->BlockPos[k]++;
+
+                ctx->BlockCount[t]--;
+                if (ctx->BlockCount[t] == 0) {
+                    ctx->WorkList[workSize++] = t;
+                }
             }
         }
-        printf("\n");
     }
-    printf("\n");
 
-    printf("Need:\n");
-    printf("      ");
-    for(int i = 0; i < M; i++) {
-        printf("R%d   ", i);
+    return unfinished;
+}
+
+// Parallel version of reduce used for large instances
+// Each round tests all remaining threads against Work in parallel and finishes every thread that fits,
+// since Work only grows; the reduction ends when a round finishes no thread
+int reduce_parallel(struct rm_ctx *ctx, int **Demand, int Finish[], int order[]) {
+    pthread_mutex_lock(&ctx->Pool->run);
+
+    memcpy(ctx->Work, ctx->AvailableRes, ctx->RowStride * sizeof(int));
+    ctx->ParDemand = Demand;
+    ctx->ParCount = 0;
+    for (int i = 0; i < ctx->N; i++) {
+        if (Finish[i] == 0) {
+            ctx->ParCand[ctx->ParCount++] = i;
+        }
     }
-    printf("\n");
-    for(int i = 0; i < N; i++) {
-        printf("T%d: ", i);
-        for (int j = 0; j < M; j++) {
-            if (j == 0) {
-                if (i / 10 == 0) {
-                    printf("%3d", NeedMat[i][j]);
-                }
-                else {
-                    printf("%2d", NeedMat[i][j]);
+
+    int unfinished = ctx->ParCount;
+    int finished = 0;
+    while (ctx->ParCount > 0) {
+        pool_run(ctx->Pool, ctx, par_test);
+
+        // Finish the threads that fit and keep the rest as candidates of the next round
+        int kept = 0;
+        ctx->ParDone = 0;
+        for (int k = 0; k < ctx->ParCount; k++) {
+            int i = ctx->ParCand[k];
+            if (ctx->ParFits[k]) {
+                Finish[i] = 1;
+                ctx->WorkList[ctx->ParDone++] = i;
+                if (order != NULL) {
+                    order[finished++] = i;
                 }
             }
             else {
-                printf("%5d", NeedMat[i][j]);
+                ctx->ParCand[kept++] = i;
             }
         }
-        printf("\n");
+        if (ctx->ParDone == 0) {
+            break;
+        }
+        ctx->ParCount = kept;
+        unfinished -= ctx->ParDone;
+
+        // Adding a few rows to Work costs less than waking the workers
+        if ((long) ctx->ParDone * ctx->RowStride < 4096) {
+            par_merge(ctx, 0, 1);
+        }
+        else {
+            pool_run(ctx->Pool, ctx, par_merge);
+        }
     }
-    printf("#########################################\n\n");
 
-    /* critical section end */
-	pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&ctx->Pool->run);
+
+    return unfinished;
 }
 
-// Additional Functions
+// Tests a share of the candidates against Work
+void par_test(struct rm_ctx *ctx, int part, int parts) {
+    int lo = (int) ((long) ctx->ParCount * part / parts);
+    int hi = (int) ((long) ctx->ParCount * (part + 1) / parts);
 
-// returns 1 if the system is currently safe, 0 if not safe, -1 if there is an error
-int safety_check() {
-    int Work[MAXR];
-    int FinishTemp[MAXP];
-    int isAllSmallerOrEqual = 1;
+    for (int k = lo; k < hi; k++) {
+        ctx->ParFits[k] = Vec.le(ctx->ParDemand[ctx->ParCand[k]], ctx->Work, ctx->RowStride);
+    }
+}
 
-    // Create a work vector and initialize it with available vector
-    for (int i = 0; i < M; i++) {
-        Work[i] = AvailableRes[i];
+// Adds the allocation of the threads finished in the round to a range of Work (whole cache lines)
+void par_merge(struct rm_ctx *ctx, int part, int parts) {
+    int lines = ctx->RowStride / LINE_INTS;
+    int lo = (int) ((long) lines * part / parts) * LINE_INTS;
+    int hi = (int) ((long) lines * (part + 1) / parts) * LINE_INTS;
+    if (lo == hi) {
+        return;
+    }
+
+    for (int f = 0; f < ctx->ParDone; f++) {
+        Vec.add(ctx->Work + lo, ctx->AllocationMat[ctx->WorkList[f]] + lo, hi - lo);
+    }
+}
+
+// returns a pool of workers - 1 helper threads, NULL if they cannot be started
+struct rm_pool *pool_create(int workers) {
+    struct rm_pool *pool = calloc(1, sizeof(struct rm_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = malloc((size_t) (workers - 1) * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
     }
 
-    for (int i = 0; i < N; i++) {
-        if (ThreadFinish[i] == 1) {
-            FinishTemp[i] = 1;
+    pthread_mutex_init(&pool->run, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int w = 0; w < workers - 1; w++) {
+        if (pthread_create(&pool->threads[w], NULL, pool_helper, pool) != 0) {
+            pool->workers = w + 1; // Only the started helpers are joined
+            pool_destroy(pool);
+            return NULL;
         }
+    }
+    pool->workers = workers;
 
-        else {
-            FinishTemp[i] = 0;
+    return pool;
+}
+
+// Stops the helpers of the pool and frees it (no task may be running)
+void pool_destroy(struct rm_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int w = 0; w < pool->workers - 1; w++) {
+        pthread_join(pool->threads[w], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run);
+    free(pool->threads);
+    free(pool);
+}
+
+// Runs the parts of the task on the pool and returns when all of them are done
+void pool_run(struct rm_pool *pool, struct rm_ctx *ctx, void (*task)(struct rm_ctx *ctx, int part, int parts)) {
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->claimed = 0;
+    pool->pending = pool->workers - 1;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(ctx, 0, pool->workers);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs one part of each task posted to the pool until the pool stops
+void *pool_helper(void *arg) {
+    struct rm_pool *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->gen == seen && pool->stop == 0) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop == 1) {
+            break;
+        }
+        seen = pool->gen;
+        int part = ++pool->claimed;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->task(pool->ctx, part, pool->workers);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
         }
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    // The main safety_check
+    return NULL;
+}
+
+// Scalar vector kernels (used when no SIMD version is supported)
+
+int le_scalar(const int *a, const int *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] > b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int gt_index_scalar(const int *a, const int *b, int n, int out[]) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (a[i] > b[i]) {
+            out[count++] = i;
+        }
+    }
+    return count;
+}
+
+int nonzero_scalar(const int *a, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void add_scalar(int *dst, const int *src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = dst[i] + src[i];
+    }
+}
+
+void sub_scalar(int *dst, const int *src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = dst[i] - src[i];
+    }
+}
+
+void max_scalar(int *dst, const int *src, int n) {
+    for (int i = 0; i < n; i++) {
+        if (src[i] > dst[i]) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// AVX2 vector kernels (8 resource types per instruction)
+
+__attribute__((target("avx2")))
+int le_avx2(const int *a, const int *b, int n) {
     int i = 0;
-    while (1) {
-        if (FinishTemp[i] == 0) {
-            // Check if the need for each resource type is less than the available pool (Work)
-            isAllSmallerOrEqual = 1;
-            for (int j = 0; j < M; j++) {
-                if (NeedMat[i][j] > Work[j]) {
-                    isAllSmallerOrEqual = 0;
-                    break;
-                }
-            }
+    for (; i + 8 <= n; i += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                        _mm256_loadu_si256((const __m256i *) (b + i)));
+        if (!_mm256_testz_si256(gt, gt)) {
+            return 0;
+        }
+    }
+    return le_scalar(a + i, b + i, n - i);
+}
 
-            // if we find a thread that need less then or equal to the available resources
-            if (isAllSmallerOrEqual == 1) {
-                // update work vector
-                for (int k = 0; k < M; k++) {
-                    Work[k] = Work[k] + AllocationMat[i][k];
-                }
-                FinishTemp[i] = 1; // Mark the thread as finished
-                i = -1; // start from the beginning (there is i++ at the end of the while loop so make it -1)
-            }
+__attribute__((target("avx2")))
+int gt_index_avx2(const int *a, const int *b, int n, int out[]) {
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                        _mm256_loadu_si256((const __m256i *) (b + i)));
+        unsigned mask = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(gt));
+        while (mask != 0) {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] > b[i]) {
+            out[count++] = i;
         }
+    }
+    return count;
+}
 
-        // If we are at the last thread to check
-        if (i == (N - 1)) {
-            for (int x = 0; x < N; x++) {
-                if (FinishTemp[x] == 0) {
-                    return 0;
-                }
-            }
+__attribute__((target("avx2")))
+int nonzero_avx2(const int *a, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (a + i));
+        if (!_mm256_testz_si256(v, v)) {
+            return 1;
+        }
+    }
+    return nonzero_scalar(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void add_avx2(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (dst + i)),
+                                     _mm256_loadu_si256((const __m256i *) (src + i)));
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+    }
+    add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void sub_avx2(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (dst + i)),
+                                     _mm256_loadu_si256((const __m256i *) (src + i)));
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+    }
+    sub_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void max_avx2(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_max_epi32(_mm256_loadu_si256((const __m256i *) (dst + i)),
+                                     _mm256_loadu_si256((const __m256i *) (src + i)));
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+    }
+    max_scalar(dst + i, src + i, n - i);
+}
+
+// SSE4.1 vector kernels (4 resource types per instruction)
+
+__attribute__((target("sse4.1")))
+int le_sse4(const int *a, const int *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) (a + i)),
+                                     _mm_loadu_si128((const __m128i *) (b + i)));
+        if (!_mm_testz_si128(gt, gt)) {
+            return 0;
+        }
+    }
+    return le_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+int gt_index_sse4(const int *a, const int *b, int n, int out[]) {
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) (a + i)),
+                                     _mm_loadu_si128((const __m128i *) (b + i)));
+        unsigned mask = (unsigned) _mm_movemask_ps(_mm_castsi128_ps(gt));
+        while (mask != 0) {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] > b[i]) {
+            out[count++] = i;
+        }
+    }
+    return count;
+}
+
+__attribute__((target("sse4.1")))
+int nonzero_sse4(const int *a, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (a + i));
+        if (!_mm_testz_si128(v, v)) {
             return 1;
         }
+    }
+    return nonzero_scalar(a + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void add_sse4(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (dst + i)),
+                                  _mm_loadu_si128((const __m128i *) (src + i)));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+    }
+    add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void sub_sse4(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (dst + i)),
+                                  _mm_loadu_si128((const __m128i *) (src + i)));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+    }
+    sub_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void max_sse4(int *dst, const int *src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_max_epi32(_mm_loadu_si128((const __m128i *) (dst + i)),
+                                  _mm_loadu_si128((const __m128i *) (src + i)));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+    }
+    max_scalar(dst + i, src + i, n - i);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+// Selects the fastest vector kernels the CPU supports
+// Threads of other instances may be calling through Vec, so it is only set once, with the final kernels
+void select_kernels() {
+    pthread_once(&KernelsOnce, init_kernels);
+}
+
+void init_kernels() {
+    struct vec_kernels kernels;
+    kernels.le = le_scalar;
+    kernels.gt_index = gt_index_scalar;
+    kernels.nonzero = nonzero_scalar;
+    kernels.add = add_scalar;
+    kernels.sub = sub_scalar;
+    kernels.max = max_scalar;
 
-        i++;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.le = le_avx2;
+        kernels.gt_index = gt_index_avx2;
+        kernels.nonzero = nonzero_avx2;
+        kernels.add = add_avx2;
+        kernels.sub = sub_avx2;
+        kernels.max = max_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        kernels.le = le_sse4;
+        kernels.gt_index = gt_index_sse4;
+        kernels.nonzero = nonzero_sse4;
+        kernels.add = add_sse4;
+        kernels.sub = sub_sse4;
+        kernels.max = max_sse4;
     }
-    // End of safety_check
+#endif
 
-    return -1; // If an error occured
+    Vec = kernels;
 }
@@ -1,8 +1,9 @@
 #ifndef RM_H
 #define RM_H
 
-#define MAXR 100 // max num of resource types supported
-#define MAXP 100 // max num of threads supported
+#include <time.h>
+
+// The num of threads and resource types are given to rm_init and only limited by memory
 
 int rm_init(int p_count, int r_count,
             int r_exist[], int avoid);
@@ -10,8 +11,241 @@ int rm_thread_started(int tid);
 int rm_thread_ended();
 int rm_claim (int claim[]); // only for avoidance
 int rm_request (int request[]);
+int rm_try_request (int request[]); // returns EWOULDBLOCK instead of waiting
+int rm_request_timed (int request[], const struct timespec *deadline); // returns ETIMEDOUT after deadline (absolute, CLOCK_MONOTONIC, tv_nsec below 1e9)
 int rm_release (int release[]);
+
+// Grant policies of the waiting requests, set by rm_set_policy (RM_POLICY_ANY by default)
+// When released resources can grant several waiting requests, they are granted in the order of the policy.
+// A waiting request is bypassed when a request that arrived after it is granted first; after max_bypass
+// bypasses, later requests wait until it is granted (max_bypass 0 with RM_POLICY_FIFO is strict FIFO,
+// -1 allows any number). Requests of threads that already hold resources are never held back, since
+// that could deadlock them
+#define RM_POLICY_ANY 0      // any request that fits (arrival order when max_bypass is not -1)
+#define RM_POLICY_FIFO 1     // arrival order
+#define RM_POLICY_PRIORITY 2 // higher priority first (rm_set_priority, 0 by default), then arrival order
+#define RM_POLICY_SMALLEST 3 // fewest requested resources first, then arrival order
+int rm_set_policy(int policy, int max_bypass);
+int rm_set_priority(int priority); // priority of the calling thread's requests
+
+// Batch of operations applied atomically by rm_batch: all releases are applied first, then the sum of
+// the requests is requested as one request, before waiting threads can take the released resources
+#define RM_OP_REQUEST 0
+#define RM_OP_RELEASE 1
+struct rm_op {
+    int type; // RM_OP_REQUEST or RM_OP_RELEASE
+    int *vec; // num of resources of each type
+};
+int rm_batch (struct rm_op ops[], int count);
+
 int rm_detection();
 void rm_print_state (char headermsg[]);
 
+// Copy of the state made by rm_snapshot without blocking the allocating threads
+// Matrices are stored row by row (n rows of m entries); finished[i] is 1 if thread i is not running
+struct rm_snapshot {
+    int n;
+    int m;
+    int *existing;
+    int *available;
+    int *finished;
+    int *allocation;
+    int *request;
+    int *max_demand;
+    int *need;
+};
+struct rm_snapshot *rm_snapshot_create(); // allocates a snapshot for the sizes given to rm_init
+int rm_snapshot(struct rm_snapshot *snap);
+void rm_snapshot_destroy(struct rm_snapshot *snap);
+
+// Time spent in the safety check and the deadlock detection since rm_init
+struct rm_timing {
+    long long safety_calls;    // num of safety checks run
+    long long safety_ns;       // total time of the safety checks in nanoseconds
+    long long safety_cached;   // num of safety checks passed by the safe sequence of the previous check
+    long long detection_calls; // num of detection runs (rm_detection and the event driven detection)
+    long long detection_ns;    // total time of the detection runs in nanoseconds
+};
+int rm_get_timing(struct rm_timing *timing);
+
+// Statistics of each thread (p_count entries) and each resource type (r_count entries) since rm_init
+// rm_get_stats fills the arrays that are not NULL. The time the locks are held is only measured after
+// rm_stats_timing(1), since it reads the clock on every lock
+struct rm_thread_stats {
+    long long requests;          // num of requests (rm_request and its variants, requests of rm_batch)
+    long long grants;            // num of granted requests
+    long long blocks;            // num of requests that waited
+    long long empty_wakeups;     // num of wakeups that found the request still not granted
+    long long safety_checks;     // num of safety checks run for the requests of the thread
+    long long rollbacks;         // num of safety checks that found the request unsafe
+    long long blocked_ns;        // total time waiting for grants in nanoseconds
+    long long mutex_held_ns;     // total time holding the global mutex in nanoseconds
+    long long type_lock_held_ns; // total time holding resource type locks in nanoseconds (detection)
+    long long aborts;            // num of requests aborted by deadlock recovery
+};
+struct rm_type_stats {
+    long long grants;            // num of granted requests including the type
+    long long units;             // num of granted resources of the type
+    long long blocks;            // num of requests that waited for the type
+};
+int rm_get_stats(struct rm_thread_stats threads[], struct rm_type_stats types[]);
+int rm_stats_timing(int enable);
+
+// Deadlock detection (only for detection)
+// rm_detection_list stores the ids of the deadlocked threads in tids (room for p_count ids) and returns their num
+// rm_detection and rm_detection_list scan a copy of the state, so requests and releases are not held up
+// Event driven detection runs each time a thread blocks in rm_request; it is enabled by setting a handler
+// or by getting the notification fd, which is an eventfd whose counter grows by one per detected deadlock
+typedef void (*rm_deadlock_handler)(int count, const int tids[], void *arg);
+int rm_detection_list(int tids[]);
+int rm_set_deadlock_handler(rm_deadlock_handler handler, void *arg);
+int rm_deadlock_fd();
+
+// Deadlock recovery (only for detection), enabled by rm_set_recovery
+// Whenever a deadlock is detected (by rm_detection or when a thread blocks), victims are picked from the
+// deadlocked threads until the rest can continue. The resources a victim holds return to the available
+// pool and its pending request returns EDEADLK; the victim then holds nothing and may retry
+#define RM_VICTIM_FEWEST_HELD 0     // fewest resources held, then youngest
+#define RM_VICTIM_LOWEST_PRIORITY 1 // lowest priority (rm_set_priority), then fewest resources held
+#define RM_VICTIM_YOUNGEST 2        // started last by rm_thread_started
+int rm_set_recovery(int enable, int victim_cost);
+
+// Parallel safety check and detection for large instances, set by rm_set_parallel (serial by default)
+// Once p_count * r_count reaches min_size, each safety check and detection pass tests the threads against
+// the available resources in rounds on a pool of workers threads, the calling thread included; workers
+// below 2 turns it off. Smaller instances keep the serial path, whose cost is lower than waking the pool
+int rm_set_parallel(int workers, long min_size);
+
+// Waiting of the threads, selected by rm_set_wait_mode for the instances created after it (rm_init included)
+// With RM_WAIT_ADAPTIVE a thread that finds the locks of the instance taken, or whose request waits, first
+// spins for about as long as such waits took recently and only then sleeps on a futex; waits that outlast
+// the spinning make later ones spin less, and there is no spinning on a single CPU. It suits workloads whose
+// releases follow the requests within microseconds. Shared instances always block
+#define RM_WAIT_BLOCK 0    // sleep in the kernel at once (default)
+#define RM_WAIT_ADAPTIVE 1 // spin, then sleep
+int rm_set_wait_mode(int mode);
+
+// Asynchronous requests for event loops
+// The rm_async_ calls act for thread id tid instead of the calling thread, so one thread can have a
+// request outstanding for each of many ids; an id is started with rm_async_started. rm_request_async
+// returns 0 if the request is granted at once and EINPROGRESS if it waits, and sets the ticket of the
+// request in both cases. When a waiting request is granted (result 0) or aborted by the deadlock recovery
+// (result EDEADLK), its completion is queued; rm_async_poll takes up to max completions, oldest first, and
+// returns their num. The eventfd of rm_async_fd becomes readable when the queue becomes non-empty: read it,
+// then poll until the queue is empty. rm_async_cancel gives up a waiting request (-1 if it already
+// completed). An id makes no other call until the completion of its waiting request is polled
+struct rm_completion {
+    unsigned long long ticket;
+    int tid;
+    int result;
+};
+int rm_async_started(int tid);
+int rm_async_ended(int tid);
+int rm_async_claim(int tid, int claim[]);
+int rm_request_async(int tid, int request[], unsigned long long *ticket);
+int rm_async_release(int tid, int release[]);
+int rm_async_poll(struct rm_completion done[], int max);
+int rm_async_fd();
+int rm_async_cancel(unsigned long long ticket);
+
+// Trace of the calls recorded by rm_trace_start for replay (see rmreplay)
+// The file holds a struct rm_trace_header and the existing resources (m ints), then one struct
+// rm_trace_event per call followed by its vector (m ints, zeros for started and ended), in host byte
+// order. Requests are recorded with the time of the call once they are granted; failed requests are left
+// out since they do not change the state, rm_batch is recorded as a release and a request, and a thread
+// whose request the deadlock recovery aborts is recorded as releasing all it held. The events of all
+// threads are numbered by seq in the order they change the state (a release before the released resources
+// can be granted again), so issuing them in that order reproduces the recorded grants
+#define RM_TRACE_MAGIC 0x32524d52 // "RMR2"
+#define RM_TRACE_STARTED 0 // rm_thread_started
+#define RM_TRACE_CLAIM 1   // rm_claim
+#define RM_TRACE_REQUEST 2 // rm_request and its variants
+#define RM_TRACE_RELEASE 3 // rm_release
+#define RM_TRACE_ENDED 4   // rm_thread_ended
+struct rm_trace_header {
+    int magic;
+    int n;     // num of threads
+    int m;     // num of resource types
+    int avoid; // avoid flag of the recorded instance
+};
+struct rm_trace_event {
+    int type;     // RM_TRACE_STARTED .. RM_TRACE_ENDED
+    int tid;      // user defined id of the thread
+    long long ns; // time of the call in nanoseconds since rm_trace_start (monotonic)
+    long long seq; // position of the event among the events of all threads, from 0
+};
+int rm_trace_start(const char *path); // creates or truncates the trace file
+int rm_trace_stop();
+
+// Independent resource manager instances
+// Each instance has its own state and locks; the functions above work on the default instance set up by
+// rm_init, and each of them has a _ctx variant taking the instance as its first argument. A thread binds
+// its id per instance with rm_thread_started_ctx and may use several instances. rm_destroy may only be
+// called when no thread uses the instance
+struct rm_ctx;
+struct rm_ctx *rm_create(int p_count, int r_count, int r_exist[], int avoid); // returns NULL on error
+void rm_destroy(struct rm_ctx *ctx);
+
+// Process-shared instances
+// rm_create_shared creates an instance in the POSIX shared memory segment name ("/name"), and other
+// processes attach it with rm_open_shared and use it through the _ctx calls with no copying; rm_init_shared
+// and rm_attach_shared do the same for the default instance. The segment is mapped at the same address in
+// every process, so rm_open_shared fails (errno EADDRINUSE) if that address is taken. The locks are robust:
+// when a process dies while holding one, the next thread taking it repairs the state, and the ids started by
+// processes that no longer exist are ended and their resources returned, which also happens whenever a
+// process attaches and every second while a request waits. A child created by fork keeps using the
+// instance of its parent. rm_destroy only unmaps a shared instance; rm_unlink_shared removes its name. Deadlock
+// handlers, eventfds, traces and rm_set_parallel belong to one process and fail on a shared instance
+struct rm_ctx *rm_create_shared(const char *name, int p_count, int r_count, int r_exist[], int avoid);
+struct rm_ctx *rm_open_shared(const char *name);
+int rm_unlink_shared(const char *name);
+int rm_init_shared(const char *name, int p_count, int r_count, int r_exist[], int avoid);
+int rm_attach_shared(const char *name);
+
+// Persistent instances
+// rm_open_file keeps the instance in the file path, so that the process hosting it can restart without its
+// clients claiming and requesting again: if the file holds an instance with the same sizes, mode and existing
+// resources, its allocations, max demands, started ids, policy, deadlock recovery and statistics are adopted
+// at once, and a new or empty file gets a new instance. The file has a versioned header with a checksum, and the state is checked
+// for consistency before it is adopted; rm_open_file fails with errno EINVAL if the file holds something
+// else and EBADMSG if the state is inconsistent (remove the file to start over). Requests that were waiting
+// when the previous process ended are dropped, handlers, eventfds, traces and rm_set_parallel are set up
+// again, and a thread continues an id by calling rm_thread_started_ctx with it. One process hosts the file
+// at a time (errno EWOULDBLOCK otherwise). rm_destroy writes the state to the file and closes it;
+// rm_init_file does the same as rm_open_file for the default instance
+struct rm_ctx *rm_open_file(const char *path, int p_count, int r_count, int r_exist[], int avoid);
+int rm_init_file(const char *path, int p_count, int r_count, int r_exist[], int avoid);
+int rm_thread_started_ctx(struct rm_ctx *ctx, int tid);
+int rm_thread_ended_ctx(struct rm_ctx *ctx);
+int rm_claim_ctx(struct rm_ctx *ctx, int claim[]);
+int rm_request_ctx(struct rm_ctx *ctx, int request[]);
+int rm_try_request_ctx(struct rm_ctx *ctx, int request[]);
+int rm_request_timed_ctx(struct rm_ctx *ctx, int request[], const struct timespec *deadline);
+int rm_release_ctx(struct rm_ctx *ctx, int release[]);
+int rm_batch_ctx(struct rm_ctx *ctx, struct rm_op ops[], int count);
+int rm_set_policy_ctx(struct rm_ctx *ctx, int policy, int max_bypass);
+int rm_set_priority_ctx(struct rm_ctx *ctx, int priority);
+int rm_detection_ctx(struct rm_ctx *ctx);
+int rm_detection_list_ctx(struct rm_ctx *ctx, int tids[]);
+int rm_set_deadlock_handler_ctx(struct rm_ctx *ctx, rm_deadlock_handler handler, void *arg);
+int rm_deadlock_fd_ctx(struct rm_ctx *ctx);
+int rm_set_recovery_ctx(struct rm_ctx *ctx, int enable, int victim_cost);
+int rm_set_parallel_ctx(struct rm_ctx *ctx, int workers, long min_size);
+int rm_get_timing_ctx(struct rm_ctx *ctx, struct rm_timing *timing);
+int rm_get_stats_ctx(struct rm_ctx *ctx, struct rm_thread_stats threads[], struct rm_type_stats types[]);
+int rm_stats_timing_ctx(struct rm_ctx *ctx, int enable);
+struct rm_snapshot *rm_snapshot_create_ctx(struct rm_ctx *ctx);
+int rm_snapshot_ctx(struct rm_ctx *ctx, struct rm_snapshot *snap);
+int rm_trace_start_ctx(struct rm_ctx *ctx, const char *path);
+int rm_trace_stop_ctx(struct rm_ctx *ctx);
+int rm_async_started_ctx(struct rm_ctx *ctx, int tid);
+int rm_async_ended_ctx(struct rm_ctx *ctx, int tid);
+int rm_async_claim_ctx(struct rm_ctx *ctx, int tid, int claim[]);
+int rm_request_async_ctx(struct rm_ctx *ctx, int tid, int request[], unsigned long long *ticket);
+int rm_async_release_ctx(struct rm_ctx *ctx, int tid, int release[]);
+int rm_async_poll_ctx(struct rm_ctx *ctx, struct rm_completion done[], int max);
+int rm_async_fd_ctx(struct rm_ctx *ctx);
+int rm_async_cancel_ctx(struct rm_ctx *ctx, unsigned long long ticket);
+void rm_print_state_ctx(struct rm_ctx *ctx, char headermsg[]);
+
 #endif /* RM_H */
\ No newline at end of file
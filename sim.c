@@ -0,0 +1,699 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "rm.h"
+
+// Discrete-event simulation of clients of the library on a virtual clock
+// A scenario file gives the resources and a script for each client. The clients run on a virtual clock
+// driven by a single thread through the rm_async_ calls, so the safety check, the detection and the grant
+// policies of the library decide every grant while no thread sleeps or waits. The result is printed as a
+// single JSON object
+//
+// Scenario file (one statement per line, # starts a comment):
+//   mode avoid|detect                          mode of the instance (avoid by default)
+//   resources E1 E2 ...                        existing units of each resource type
+//   policy any|fifo|priority|smallest [BYPASS] grant policy (rm_set_policy)
+//   recovery fewest|priority|youngest          deadlock recovery of detection mode (rm_set_recovery)
+//   client A[-B]                               the following lines are the script of clients A..B
+//     claim V1 V2 ...                          max demand (only used in avoidance mode)
+//     request V1 V2 ...                        request, waiting on the virtual clock until it is granted
+//     release V1 V2 ...|all                    release (at most what the client holds)
+//     wait T                                   advance the client by T time units
+//     repeat K ... end                         run the lines in between K times (may be nested)
+//     print TEXT                               print the state (rm_print_state)
+// A value is either a number N or a range LO-HI drawn uniformly for each execution. A client starts at
+// time 0 and ends after its last line, keeping what it still holds
+
+#define MAX_LINE 1024
+#define MAX_DEPTH 16 // deepest nesting of repeat
+
+#define OP_CLAIM 0
+#define OP_REQUEST 1
+#define OP_RELEASE 2
+#define OP_RELEASE_ALL 3
+#define OP_WAIT 4
+#define OP_REPEAT 5
+#define OP_END 6
+#define OP_PRINT 7
+
+// A value drawn uniformly from lo..hi
+struct range {
+    int lo;
+    int hi;
+};
+
+// A line of a script
+struct op {
+    int type;
+    struct range *vec;   // M values (claim, request, release)
+    struct range arg;    // time of wait, count of repeat
+    int match;           // index of the matching end of a repeat or repeat of an end
+    char *text;          // text of print
+};
+
+// Script shared by a range of clients
+struct script {
+    struct op *ops;
+    int count;
+    int capacity;
+};
+
+// State of a simulated client
+struct client {
+    struct script *script; // NULL if the scenario has no script for the client
+    int pc;                // index of the next line
+    int depth;
+    int loopLeft[MAX_DEPTH]; // iterations left of each open repeat
+    int *held;             // resources the client holds
+    int *pending;          // resources of the waiting request
+    int waiting;           // 1 while the request waits
+    long long waitStart;   // virtual time the request started waiting
+};
+
+// An event of the virtual clock: the client continues at time
+struct event {
+    long long time;
+    long long seq; // events at the same time run in the order they were scheduled
+    int client;
+};
+
+// Global Variables
+int numClients = 0;
+int numTypes = 0;
+int avoid = 1;
+int policy = RM_POLICY_ANY;
+int maxBypass = -1;
+int recovery = -1;        // victim cost of the recovery, -1 if disabled
+int *exist = NULL;
+unsigned long long seed = 1;
+unsigned long long rng;     // state of the random generator
+
+struct rm_ctx *ctx;
+struct client *clients;
+struct script **scripts;  // all scripts, to free them
+int numScripts = 0;
+
+struct event *heap;       // min-heap of the events by time and seq
+int heapSize = 0;
+long long nextSeq = 0;
+long long now = 0;
+
+long long calls = 0, grants = 0, blocks = 0, aborts = 0, errors = 0;
+long long waitTime = 0;   // total virtual time the requests waited
+long long waitingCount = 0;
+long long *allocated;     // resources of each type held by the clients
+double *area;             // integral of allocated over the virtual time
+
+struct rm_completion *done;
+int *vec;                 // scratch vector
+
+// Function Signatures
+void parse_scenario(const char *path);
+void parse_range(const char *word, struct range *r, const char *path, int line);
+struct op *add_op(struct script *s);
+void run_client(int c);
+void take_done();
+void advance(long long time);
+void push_event(long long time, int client);
+int pop_event(struct event *e);
+int draw(struct range r);
+void draw_vec(struct range *ranges, int *out);
+void fail(const char *path, int line, const char *msg);
+long long now_ns();
+void usage();
+
+// Main Function
+int main(int argc, char **argv) {
+    int opt;
+    int modeSet = -1;
+    char *existArg = NULL;
+
+    while ((opt = getopt(argc, argv, "m:e:s:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "avoid") == 0) {
+                modeSet = 1;
+            }
+            else if (strcmp(optarg, "detect") == 0) {
+                modeSet = 0;
+            }
+            else {
+                usage();
+            }
+            break;
+        case 'e': existArg = optarg; break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        default: usage();
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+    }
+    rng = (seed != 0) ? seed : 1;
+
+    parse_scenario(argv[optind]);
+    if (modeSet != -1) {
+        avoid = modeSet;
+    }
+
+    // Capacities given on the command line replace the ones of the scenario
+    if (existArg != NULL) {
+        char *save = NULL;
+        int j = 0;
+        for (char *word = strtok_r(existArg, ",", &save); word != NULL; word = strtok_r(NULL, ",", &save)) {
+            if (j == numTypes) {
+                usage();
+            }
+            exist[j++] = atoi(word);
+        }
+        if (j != numTypes) {
+            usage();
+        }
+    }
+
+    ctx = rm_create(numClients, numTypes, exist, avoid);
+    if (ctx == NULL) {
+        fprintf(stderr, "rmsim: rm_create failed\n");
+        exit(1);
+    }
+    if (policy != RM_POLICY_ANY || maxBypass != -1) {
+        rm_set_policy_ctx(ctx, policy, maxBypass);
+    }
+    if (recovery != -1 && rm_set_recovery_ctx(ctx, 1, recovery) != 0) {
+        fprintf(stderr, "rmsim: recovery is only used in detection mode\n");
+        exit(1);
+    }
+
+    allocated = calloc(numTypes, sizeof(long long));
+    area = calloc(numTypes, sizeof(double));
+    done = malloc(numClients * sizeof(struct rm_completion));
+    vec = malloc(numTypes * sizeof(int));
+    heap = malloc(numClients * sizeof(struct event));
+    if (allocated == NULL || area == NULL || done == NULL || vec == NULL || heap == NULL) {
+        fprintf(stderr, "rmsim: out of memory\n");
+        exit(1);
+    }
+
+    long long start = now_ns();
+
+    for (int c = 0; c < numClients; c++) {
+        if (clients[c].script != NULL) {
+            rm_async_started_ctx(ctx, c);
+            calls++;
+            push_event(0, c);
+        }
+    }
+
+    // Run the clients until none of them can continue
+    int deadlocked = 0;
+    struct event e;
+    while (1) {
+        while (pop_event(&e)) {
+            advance(e.time);
+            run_client(e.client);
+        }
+
+        if (waitingCount == 0) {
+            break;
+        }
+
+        // Requests still wait while no client runs; in detection mode the detection may recover
+        if (avoid == 0) {
+            deadlocked = rm_detection_ctx(ctx);
+            calls++;
+            take_done();
+            if (heapSize > 0) {
+                continue;
+            }
+        }
+        break;
+    }
+
+    long long elapsed = now_ns() - start;
+
+    struct rm_timing timing;
+    rm_get_timing_ctx(ctx, &timing);
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"clients\":%d,\"types\":%d,\"seed\":%llu,",
+           argv[optind], avoid ? "avoid" : "detect", numClients, numTypes, seed);
+    printf("\"calls\":%lld,\"elapsed_s\":%.6f,\"calls_per_sec\":%.1f,\"virtual_time\":%lld,",
+           calls, elapsed / 1e9, calls / (elapsed / 1e9), now);
+    printf("\"grants\":%lld,\"blocks\":%lld,\"mean_wait\":%.3f,\"aborts\":%lld,\"errors\":%lld,",
+           grants, blocks, blocks ? (double) waitTime / blocks : 0.0, aborts, errors);
+    printf("\"stuck\":%lld,\"deadlocked\":%d,\"utilization\":[", waitingCount, deadlocked > 0 ? deadlocked : 0);
+    for (int j = 0; j < numTypes; j++) {
+        printf("%s%.4f", j ? "," : "", (now > 0 && exist[j] > 0) ? area[j] / ((double) now * exist[j]) : 0.0);
+    }
+    printf("],\"safety_check\":{\"calls\":%lld,\"cached\":%lld,\"ns\":%lld}", timing.safety_calls,
+           timing.safety_cached, timing.safety_ns);
+    printf(",\"detection\":{\"calls\":%lld,\"ns\":%lld}}\n", timing.detection_calls, timing.detection_ns);
+
+    rm_destroy(ctx);
+
+    return (waitingCount == 0 && errors == 0) ? 0 : 1;
+}
+
+// Reads the scenario file
+void parse_scenario(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "rmsim: cannot open %s\n", path);
+        exit(1);
+    }
+
+    char line[MAX_LINE];
+    int lineNo = 0;
+    int capacity = 0;
+    struct script *current = NULL;
+    int open[MAX_DEPTH]; // indexes of the open repeats of the current script
+    int depth = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNo++;
+
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+
+        char *save = NULL;
+        char *word = strtok_r(line, " \t\r\n", &save);
+        if (word == NULL) {
+            continue;
+        }
+
+        if (strcmp(word, "mode") == 0) {
+            word = strtok_r(NULL, " \t\r\n", &save);
+            if (word == NULL || (strcmp(word, "avoid") != 0 && strcmp(word, "detect") != 0)) {
+                fail(path, lineNo, "mode is avoid or detect");
+            }
+            avoid = strcmp(word, "avoid") == 0;
+        }
+        else if (strcmp(word, "resources") == 0) {
+            if (numTypes > 0) {
+                fail(path, lineNo, "resources given twice");
+            }
+            exist = malloc(MAX_LINE * sizeof(int));
+            while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+                exist[numTypes++] = atoi(word);
+            }
+            if (numTypes == 0) {
+                fail(path, lineNo, "no resources");
+            }
+        }
+        else if (strcmp(word, "policy") == 0) {
+            static const char *names[] = {"any", "fifo", "priority", "smallest"};
+            word = strtok_r(NULL, " \t\r\n", &save);
+            policy = -1;
+            for (int k = 0; word != NULL && k < 4; k++) {
+                if (strcmp(word, names[k]) == 0) {
+                    policy = k;
+                }
+            }
+            if (policy == -1) {
+                fail(path, lineNo, "policy is any, fifo, priority or smallest");
+            }
+            word = strtok_r(NULL, " \t\r\n", &save);
+            maxBypass = (word != NULL) ? atoi(word) : -1;
+        }
+        else if (strcmp(word, "recovery") == 0) {
+            static const char *names[] = {"fewest", "priority", "youngest"};
+            word = strtok_r(NULL, " \t\r\n", &save);
+            for (int k = 0; word != NULL && k < 3; k++) {
+                if (strcmp(word, names[k]) == 0) {
+                    recovery = k;
+                }
+            }
+            if (recovery == -1) {
+                fail(path, lineNo, "recovery is fewest, priority or youngest");
+            }
+        }
+        else if (strcmp(word, "client") == 0) {
+            struct range ids;
+            word = strtok_r(NULL, " \t\r\n", &save);
+            if (word == NULL) {
+                fail(path, lineNo, "client without id");
+            }
+            parse_range(word, &ids, path, lineNo);
+            if (depth > 0) {
+                fail(path, lineNo, "repeat without end");
+            }
+
+            current = calloc(1, sizeof(struct script));
+            scripts = realloc(scripts, (numScripts + 1) * sizeof(struct script*));
+            scripts[numScripts++] = current;
+
+            if (ids.hi >= capacity) {
+                int grown = ids.hi + 1;
+                clients = realloc(clients, grown * sizeof(struct client));
+                memset(clients + capacity, 0, (grown - capacity) * sizeof(struct client));
+                capacity = grown;
+            }
+            for (int c = ids.lo; c <= ids.hi; c++) {
+                clients[c].script = current;
+            }
+            if (ids.hi + 1 > numClients) {
+                numClients = ids.hi + 1;
+            }
+        }
+        else {
+            if (current == NULL) {
+                fail(path, lineNo, "script line before client");
+            }
+            if (numTypes == 0) {
+                fail(path, lineNo, "resources must come before the scripts");
+            }
+
+            struct op *op = add_op(current);
+            int index = current->count - 1;
+
+            if (strcmp(word, "claim") == 0 || strcmp(word, "request") == 0 || strcmp(word, "release") == 0) {
+                op->type = (word[0] == 'c') ? OP_CLAIM : (word[2] == 'q') ? OP_REQUEST : OP_RELEASE;
+                op->vec = malloc(numTypes * sizeof(struct range));
+                int j = 0;
+                while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+                    if (op->type == OP_RELEASE && j == 0 && strcmp(word, "all") == 0) {
+                        op->type = OP_RELEASE_ALL;
+                        j = numTypes;
+                        break;
+                    }
+                    if (j == numTypes) {
+                        fail(path, lineNo, "more values than resource types");
+                    }
+                    parse_range(word, &op->vec[j++], path, lineNo);
+                }
+                if (j != numTypes) {
+                    fail(path, lineNo, "fewer values than resource types");
+                }
+            }
+            else if (strcmp(word, "wait") == 0 || strcmp(word, "repeat") == 0) {
+                op->type = (word[0] == 'w') ? OP_WAIT : OP_REPEAT;
+                word = strtok_r(NULL, " \t\r\n", &save);
+                if (word == NULL) {
+                    fail(path, lineNo, "missing value");
+                }
+                parse_range(word, &op->arg, path, lineNo);
+                if (op->type == OP_REPEAT) {
+                    if (depth == MAX_DEPTH) {
+                        fail(path, lineNo, "repeat nested too deep");
+                    }
+                    open[depth++] = index;
+                }
+            }
+            else if (strcmp(word, "end") == 0) {
+                if (depth == 0) {
+                    fail(path, lineNo, "end without repeat");
+                }
+                op->type = OP_END;
+                op->match = open[--depth];
+                current->ops[op->match].match = index;
+            }
+            else if (strcmp(word, "print") == 0) {
+                op->type = OP_PRINT;
+                word = strtok_r(NULL, "\r\n", &save);
+                op->text = strdup(word != NULL ? word : "");
+            }
+            else {
+                fail(path, lineNo, "unknown statement");
+            }
+        }
+    }
+
+    fclose(file);
+
+    if (depth > 0) {
+        fail(path, lineNo, "repeat without end");
+    }
+    if (numTypes == 0 || numClients == 0) {
+        fail(path, lineNo, "no resources or no clients");
+    }
+
+    for (int c = 0; c < numClients; c++) {
+        clients[c].held = calloc(numTypes, sizeof(int));
+        clients[c].pending = calloc(numTypes, sizeof(int));
+        if (clients[c].held == NULL || clients[c].pending == NULL) {
+            fprintf(stderr, "rmsim: out of memory\n");
+            exit(1);
+        }
+    }
+}
+
+// Reads N or LO-HI into r
+void parse_range(const char *word, struct range *r, const char *path, int line) {
+    char *rest;
+    r->lo = (int) strtol(word, &rest, 10);
+    r->hi = r->lo;
+    if (*rest == '-') {
+        r->hi = (int) strtol(rest + 1, &rest, 10);
+    }
+    if (*rest != '\0' || rest == word || r->lo < 0 || r->hi < r->lo) {
+        fail(path, line, "bad value");
+    }
+}
+
+struct op *add_op(struct script *s) {
+    if (s->count == s->capacity) {
+        s->capacity = (s->capacity == 0) ? 16 : 2 * s->capacity;
+        s->ops = realloc(s->ops, s->capacity * sizeof(struct op));
+        if (s->ops == NULL) {
+            fprintf(stderr, "rmsim: out of memory\n");
+            exit(1);
+        }
+    }
+
+    struct op *op = &s->ops[s->count++];
+    memset(op, 0, sizeof(struct op));
+    return op;
+}
+
+// Runs the client from its next line until it waits on the clock, its request waits or its script ends
+void run_client(int c) {
+    struct client *cl = &clients[c];
+    struct script *s = cl->script;
+
+    while (cl->pc < s->count) {
+        struct op *op = &s->ops[cl->pc];
+        unsigned long long ticket;
+        int ret;
+
+        switch (op->type) {
+        case OP_CLAIM:
+            // Claims only matter to the avoidance
+            if (avoid) {
+                draw_vec(op->vec, vec);
+                calls++;
+                if (rm_async_claim_ctx(ctx, c, vec) != 0) {
+                    errors++;
+                }
+            }
+            break;
+
+        case OP_REQUEST:
+            draw_vec(op->vec, cl->pending);
+            calls++;
+            ret = rm_request_async_ctx(ctx, c, cl->pending, &ticket);
+            if (ret == 0) {
+                grants++;
+                for (int j = 0; j < numTypes; j++) {
+                    cl->held[j] += cl->pending[j];
+                    allocated[j] += cl->pending[j];
+                }
+            }
+            else if (ret == EINPROGRESS) {
+                cl->waiting = 1;
+                cl->waitStart = now;
+                waitingCount++;
+                blocks++;
+                take_done(); // The recovery may have ended the wait of this or other requests
+                return;
+            }
+            else {
+                errors++;
+            }
+            break;
+
+        case OP_RELEASE:
+        case OP_RELEASE_ALL:
+            if (op->type == OP_RELEASE) {
+                draw_vec(op->vec, vec);
+                for (int j = 0; j < numTypes; j++) {
+                    vec[j] = (vec[j] < cl->held[j]) ? vec[j] : cl->held[j];
+                }
+            }
+            else {
+                memcpy(vec, cl->held, numTypes * sizeof(int));
+            }
+            calls++;
+            if (rm_async_release_ctx(ctx, c, vec) == 0) {
+                for (int j = 0; j < numTypes; j++) {
+                    cl->held[j] -= vec[j];
+                    allocated[j] -= vec[j];
+                }
+                take_done();
+            }
+            else {
+                errors++;
+            }
+            break;
+
+        case OP_WAIT:
+            cl->pc++;
+            push_event(now + draw(op->arg), c);
+            return;
+
+        case OP_REPEAT:
+            if (cl->depth == MAX_DEPTH) {
+                errors++;
+                return;
+            }
+            cl->loopLeft[cl->depth] = draw(op->arg);
+            if (cl->loopLeft[cl->depth] == 0) {
+                cl->pc = op->match; // Skip the body
+            }
+            else {
+                cl->depth++;
+            }
+            break;
+
+        case OP_END:
+            if (--cl->loopLeft[cl->depth - 1] > 0) {
+                cl->pc = op->match; // Run the body again
+            }
+            else {
+                cl->depth--;
+            }
+            break;
+
+        case OP_PRINT:
+            rm_print_state_ctx(ctx, op->text);
+            break;
+        }
+
+        cl->pc++;
+    }
+
+    // The script ended
+    calls++;
+    rm_async_ended_ctx(ctx, c);
+    take_done();
+}
+
+// Continues the clients whose waiting requests ended
+void take_done() {
+    int count = rm_async_poll_ctx(ctx, done, numClients);
+
+    for (int k = 0; k < count; k++) {
+        struct client *cl = &clients[done[k].tid];
+
+        cl->waiting = 0;
+        waitingCount--;
+        waitTime += now - cl->waitStart;
+
+        if (done[k].result == 0) {
+            grants++;
+            for (int j = 0; j < numTypes; j++) {
+                cl->held[j] += cl->pending[j];
+                allocated[j] += cl->pending[j];
+            }
+        }
+        else {
+            // Aborted by the recovery, which took back everything the client held
+            aborts++;
+            for (int j = 0; j < numTypes; j++) {
+                allocated[j] -= cl->held[j];
+                cl->held[j] = 0;
+            }
+        }
+
+        cl->pc++; // Past the request
+        push_event(now, done[k].tid);
+    }
+}
+
+// Moves the clock to time and adds the allocation until then to the utilization
+void advance(long long time) {
+    for (int j = 0; j < numTypes; j++) {
+        area[j] += (double) allocated[j] * (time - now);
+    }
+    now = time;
+}
+
+// A client has at most one event, so the heap never holds more than numClients events
+void push_event(long long time, int client) {
+    int i = heapSize++;
+    struct event e = {time, nextSeq++, client};
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent].time < e.time || (heap[parent].time == e.time && heap[parent].seq < e.seq)) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = e;
+}
+
+// returns 1 and the earliest event in e, 0 if there is none
+int pop_event(struct event *e) {
+    if (heapSize == 0) {
+        return 0;
+    }
+
+    *e = heap[0];
+    struct event last = heap[--heapSize];
+    int i = 0;
+    while (2 * i + 1 < heapSize) {
+        int child = 2 * i + 1;
+        if (child + 1 < heapSize && (heap[child + 1].time < heap[child].time ||
+            (heap[child + 1].time == heap[child].time && heap[child + 1].seq < heap[child].seq))) {
+            child++;
+        }
+        if (last.time < heap[child].time || (last.time == heap[child].time && last.seq < heap[child].seq)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return 1;
+}
+
+// returns a value drawn uniformly from the range (xorshift64*)
+int draw(struct range r) {
+    if (r.lo == r.hi) {
+        return r.lo;
+    }
+
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return r.lo + (int) ((rng * 2685821657736338717ULL) >> 33) % (r.hi - r.lo + 1);
+}
+
+void draw_vec(struct range *ranges, int *out) {
+    for (int j = 0; j < numTypes; j++) {
+        out[j] = draw(ranges[j]);
+    }
+}
+
+void fail(const char *path, int line, const char *msg) {
+    fprintf(stderr, "rmsim: %s:%d: %s\n", path, line, msg);
+    exit(1);
+}
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./rmsim [-m avoid|detect] [-e E1,E2,...] [-s seed] scenario\n");
+    exit(1);
+}